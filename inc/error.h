@@ -10,6 +10,11 @@ struct RuntimeError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+// Raised when an allocation would exceed the heap limits even after a collection.
+struct OutOfMemory : public RuntimeError {
+    using RuntimeError::RuntimeError;
+};
+
 struct NameError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
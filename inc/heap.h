@@ -0,0 +1,703 @@
+#pragma once
+
+#include "error.h"
+#include "object.h"
+
+#include <cstddef>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Decides when allocation pressure is high enough to start a collection.
+// A collection is due once the heap reaches the threshold; afterwards the threshold is moved
+// to `growth_factor` times the surviving bytes, but never below the configured minimum.
+
+class GcPolicy {
+public:
+    static constexpr size_t kDefaultThreshold = 1 << 20;
+    static constexpr double kDefaultGrowthFactor = 2.0;
+
+    void SetThreshold(size_t bytes);
+    void SetGrowthFactor(double factor);
+
+    size_t GetThreshold() const;
+    double GetGrowthFactor() const;
+
+    bool ShouldCollect(size_t heap_bytes) const;
+    void OnCollection(size_t live_bytes);
+
+    static constexpr size_t kDefaultNurserySize = 256 * 1024;
+
+    // Size of the young generation at which a minor collection is started.
+    void SetNurserySize(size_t bytes);
+    size_t GetNurserySize() const;
+
+    bool ShouldCollectYoung(size_t young_bytes) const;
+
+private:
+    size_t nursery_size_ = kDefaultNurserySize;
+    size_t threshold_ = kDefaultThreshold;
+    double growth_factor_ = kDefaultGrowthFactor;
+    size_t next_collection_ = kDefaultThreshold;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Heap usage and collector activity, see Interpreter::HeapStats.
+
+struct HeapStatistics {
+    struct TypeStatistics {
+        size_t count = 0;
+        size_t bytes = 0;
+    };
+
+    // Objects currently allocated, per concrete type. Preallocated numbers and booleans
+    // are not included, nor are constants, which are counted apart.
+    TypeStatistics numbers;
+    TypeStatistics cells;
+    TypeStatistics lists;
+    TypeStatistics scopes;
+    TypeStatistics lambdas;
+    TypeStatistics symbols;
+    TypeStatistics others;
+    TypeStatistics constants;
+
+    size_t heap_bytes = 0;
+    size_t peak_heap_bytes = 0;
+
+    // Full and minor collections, minor ones are also counted in `collections`.
+    size_t collections = 0;
+    size_t minor_collections = 0;
+    // Percentiles are taken over the most recent GcLog::kPauseHistory collections.
+    std::chrono::nanoseconds total_pause{0};
+    std::chrono::nanoseconds p50_pause{0};
+    std::chrono::nanoseconds p99_pause{0};
+    std::chrono::nanoseconds max_pause{0};
+    size_t last_reclaimed_bytes = 0;
+    size_t total_reclaimed_bytes = 0;
+
+    std::string ToString() const;
+};
+
+// Records the pauses and reclaimed bytes of collections without allocating.
+class GcLog {
+public:
+    static constexpr size_t kPauseHistory = 1024;
+
+    void Record(std::chrono::nanoseconds pause, bool minor);
+    // Called when the sweep of a collection is over, possibly long after its pause.
+    void RecordReclaimed(size_t bytes);
+    void Fill(HeapStatistics* stats) const;
+
+private:
+    std::array<std::chrono::nanoseconds, kPauseHistory> pauses_{};
+    size_t collections_ = 0;
+    size_t minor_collections_ = 0;
+    std::chrono::nanoseconds total_pause_{0};
+    std::chrono::nanoseconds max_pause_{0};
+    size_t last_reclaimed_bytes_ = 0;
+    size_t total_reclaimed_bytes_ = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Slab allocator for interpreter objects.
+// Objects are rounded up to a size class and carved out of fixed-size pages that belong
+// to that class, so objects of similar size are packed densely next to each other.
+// Every allocated object is linked into an intrusive live list which the collector walks
+// using the mark bit stored in the object header; erased objects go back to the free list
+// of their size class.
+//
+// Objects are split into two generations. New objects are young; those surviving a
+// collection are promoted to the old generation. A minor collection marks and sweeps only
+// young objects, so every old object that may point to a young one has to be recorded by
+// the write barrier in the remembered set, which serves as an extra set of roots.
+//
+// Every interpreter owns a separate heap. Each page starts with a pointer to its heap, so
+// the heap of any object can be found from its address alone.
+//
+// Booleans and small numbers are immutable and preallocated once per heap in a permanent
+// space which is never marked nor swept, so arithmetic and predicates on them do not
+// allocate.
+//
+// Number literals and symbols made by the reader are interned into a constant pool: equal
+// constants are a single object. Constants are ordinary heap objects which count towards the
+// heap size and its limits. The pool does not keep them alive, a collection drops those it
+// did not mark. Cells are mutable and are never pooled, so quoted data is read into the arena
+// like code and every evaluation of a quote copies it into the heap.
+//
+// The heap size accounts for the slots of all objects together with the memory they own
+// outside of the heap. It can be capped by byte and object limits; an allocation that would
+// exceed them first triggers an emergency collection at a safepoint and raises OutOfMemory
+// if that does not free enough.
+//
+// Collections may also run in the middle of evaluation: while safepoints are enabled, every
+// allocation of kSafepointInterval bytes calls the collector before the new object is made.
+// C++ locals referring to objects must then be registered in a RootScope, which records
+// them on a shadow stack traced as extra roots.
+//
+// Code read by the parser is made of cells allocated from an arena rather than the heap.
+// Arena cells are treated as permanent by the collector and are all released at once when
+// the arena is reset, so a parse tree does not have to be traced or swept. Code which
+// outlives the evaluation that read it, such as the body of a lambda, has to be promoted into
+// the heap first.
+//
+// Sweeping after a full collection may be lazy: the swept lists are set aside and a few of
+// their objects are erased or promoted on each later allocation, so the pause does not
+// depend on the amount of garbage. A new collection first finishes the pending sweep.
+//
+// A full collection may also mark concurrently with the mutator. While marking is active
+// the write barrier locks the heap mutex and logs every overwritten reference, so that
+// everything reachable when marking started gets marked (snapshot-at-the-beginning), and
+// new objects are allocated already marked.
+
+class Heap {
+public:
+    static constexpr size_t kPageSize = 64 * 1024;
+    static constexpr size_t kSlotAlignment = 8;
+    static constexpr size_t kMaxSlotSize = 256;
+    static constexpr size_t kSizeClassCount = kMaxSlotSize / kSlotAlignment;
+    static constexpr int64_t kMinCachedNumber = -1024;
+    static constexpr int64_t kMaxCachedNumber = 1024;
+    static constexpr size_t kSafepointInterval = 64 * 1024;
+
+    Heap();
+    ~Heap();
+
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    template <typename T>
+    auto Make() {
+        return Maker<T>{this};
+    }
+
+    // Returns the heap which allocated `ptr`, found through the header of its page.
+    static inline Heap& Of(const Object* ptr) {
+        auto address = reinterpret_cast<uintptr_t>(ptr) & ~(kPageSize - 1);
+        return *reinterpret_cast<const Page*>(address)->heap;
+    }
+
+    // Returns a shared permanent object for small values.
+    inline NumberPtr GetNumber(int64_t value) {
+        if (value >= kMinCachedNumber && value < kMaxCachedNumber) {
+            return numbers_[value - kMinCachedNumber];
+        }
+        return Make<Number>().From(value);
+    }
+
+    inline BooleanPtr GetBoolean(bool value) {
+        return value ? true_ : false_;
+    }
+
+    // Return the pooled constant with the given contents, making it if there is none yet.
+    // Making one may collect garbage at a safepoint.
+    NumberPtr InternNumber(int64_t value);
+    SymbolPtr InternSymbol(const std::string& name);
+
+    // Sets the mark bit of `ptr`, returns false if it was already set or the object is
+    // permanent. Safe to call from several marking threads at once.
+    inline bool Mark(ObjectPtr ptr) {
+        if (ptr->permanent_ || ptr->marked_.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        return !ptr->marked_.exchange(true, std::memory_order_relaxed);
+    }
+
+    inline bool IsOld(ObjectPtr ptr) const {
+        return ptr->old_;
+    }
+
+    inline bool IsArena(ObjectPtr ptr) const {
+        return ptr->arena_;
+    }
+
+    // Arena cells may only refer to constants and other arena cells. The constants are kept
+    // alive until the arena is reset.
+    CellPtr MakeArenaCell(ObjectPtr first, ObjectPtr second);
+    // Returns a copy of `object` made in the heap if it is in the arena, or `object` itself.
+    // Copies are shallow up to the first object outside of the arena.
+    ObjectPtr Promote(ObjectPtr object);
+    // Releases every arena cell.
+    void ResetArena();
+
+    // Records `holder` in the remembered set if storing `value` into it creates
+    // an old-to-young reference. Arena cells are released at the end of the Run and are
+    // never recorded.
+    inline void Remember(ObjectPtr holder, ObjectPtr value) {
+        if (value && holder->old_ && !value->old_ && !holder->remembered_ && !holder->arena_) {
+            holder->remembered_ = true;
+            remembered_.push_back(holder);
+        }
+    }
+
+    // Old objects which may hold references to young ones.
+    inline const std::vector<ObjectPtr>& GetRemembered() const {
+        return remembered_;
+    }
+
+    // Concurrent marking. The marking thread has to hold the mutation mutex while it reads
+    // references of an object, and drains the log of overwritten references with it held.
+    void StartMarking();
+    void FinishMarking();
+
+    inline bool IsMarking() const {
+        return marking_;
+    }
+
+    inline std::mutex& GetMutationMutex() {
+        return mutation_mutex_;
+    }
+
+    void DrainOverwritten(Tracer* tracer);
+
+    // Moves every marked cell into fresh pages so that each chain of cdrs is laid out
+    // contiguously, and redirects all references held by marked objects to the copies.
+    // Must run between marking and sweeping, with no references held outside the heap.
+    void CompactCells();
+
+    // Called at allocations while safepoints are enabled, may collect garbage. Collection is
+    // mandatory when `emergency` is set, as the heap is over its limits.
+    void SetCollector(std::function<void(bool emergency)> collector);
+
+    // Limits on heap bytes and the number of objects, zero means no limit.
+    void SetByteLimit(size_t bytes);
+    void SetObjectLimit(size_t count);
+
+    // Accounts for memory `holder` acquired outside of the heap after it was made.
+    inline void AddExternalSize(ObjectPtr holder, size_t bytes) {
+        size_ += bytes;
+        peak_size_ = std::max(peak_size_, size_);
+        if (!holder->old_) {
+            young_size_ += bytes;
+        }
+    }
+
+    inline void RemoveExternalSize(ObjectPtr holder, size_t bytes) {
+        size_ -= bytes;
+        if (!holder->old_) {
+            young_size_ -= std::min(young_size_, bytes);
+        }
+    }
+
+    // Frame stack. Calls whose scope can not outlive them take it from here, and the scope is
+    // reset and kept for the next call on return, so such calls leave no garbage behind. A
+    // frame captured by a lambda after all is left to the collector instead.
+    ScopePtr PushFrame(ScopePtr parent);
+    void PopFrame();
+    // Lets the collector reclaim the frames above the top of the stack. Must be called before
+    // marking starts.
+    void ReleaseIdleFrames();
+
+    // Budget for the control stack of evaluation in bytes, zero means no limit. Frames of the
+    // machine are charged through ReserveStack, C++ recursion by how far the native stack
+    // grew since the base. Running out of it raises RuntimeError.
+    void SetStackLimit(size_t bytes);
+    void ReserveStack(size_t bytes);
+    void ReleaseStack(size_t bytes);
+    // Marks where the native stack of the running evaluation starts.
+    void SetStackBase(const void* base);
+    // Called on every level of C++ recursion during evaluation and parsing.
+    void CheckNativeStack() const;
+
+    inline void EnableSafepoints(bool enabled) {
+        safepoints_ = enabled;
+    }
+
+    // Visits the objects referred to from the shadow stack, the frame stack and from arena
+    // cells. Objects on the shadow stack must not be moved, as tracers are only handed
+    // copies of the locals.
+    void TraceRoots(Tracer* tracer);
+
+    // Erases every unmarked object and clears the mark bits of the survivors.
+    void Sweep();
+    // Sets every object aside to be swept by later allocations, marking must not start
+    // before FinishSweep.
+    void StartSweep();
+    void FinishSweep();
+
+    inline bool IsSweeping() const {
+        return sweeping_;
+    }
+
+    // Returns true once after each sweep is over, along with the bytes of the survivors and
+    // of the erased objects.
+    bool TakeSweepResult(size_t* live_bytes, size_t* reclaimed_bytes);
+
+    // Erases unmarked young objects, old objects are left untouched.
+    void SweepYoung();
+
+    // Bytes occupied by allocated objects, including slot padding.
+    inline size_t GetSize() const {
+        return size_;
+    }
+
+    inline size_t GetYoungSize() const {
+        return young_size_;
+    }
+
+    inline size_t GetObjectCount() const {
+        return object_count_;
+    }
+
+    inline size_t GetPeakSize() const {
+        return peak_size_;
+    }
+
+    // Fills in the per type counters and heap sizes of `stats`.
+    void CountObjects(HeapStatistics* stats) const;
+
+private:
+    friend class WriteBarrier;
+    friend class RootScope;
+
+    template <typename T>
+    struct Maker {
+        template <typename... Args>
+        T* From(Args&&... args) {
+            if (!std::is_base_of_v<Object, T>) {
+                throw RuntimeError("Trying to create Object of wrong type!");
+            }
+            heap->Safepoint();
+            if (heap->sweeping_) {
+                heap->SweepUnswept(kSweepBatch, true);
+            }
+            heap->Reserve(SlotSize(SizeClassOf(sizeof(T))));
+            T* object = heap->Construct<T>(std::forward<Args>(args)...);
+            object->marked_.store(heap->marking_, std::memory_order_relaxed);
+            size_t size = SlotSize(object->size_class_) + object->GetExternalSize();
+            heap->size_ += size;
+            heap->peak_size_ = std::max(heap->peak_size_, heap->size_);
+            heap->young_size_ += size;
+            heap->allocated_since_safepoint_ += size;
+            ++heap->object_count_;
+            object->heap_next_ = heap->young_;
+            heap->young_ = object;
+            return object;
+        }
+
+        Heap* heap;
+    };
+
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    // Header at the start of every page, slots follow it.
+    struct alignas(kSlotAlignment) Page {
+        Page* next;
+        Heap* heap;
+    };
+
+    // A registered local, `trace` knows how to read objects from the slot.
+    struct Root {
+        const void* slot;
+        void (*trace)(const void* slot, Tracer* tracer);
+    };
+
+    struct SizeClass {
+        FreeSlot* free = nullptr;
+        char* cursor = nullptr;
+        char* end = nullptr;
+    };
+
+    static constexpr uint8_t SizeClassOf(size_t size) {
+        return static_cast<uint8_t>((size + kSlotAlignment - 1) / kSlotAlignment - 1);
+    }
+
+    static constexpr size_t SlotSize(uint8_t size_class) {
+        return (size_class + 1) * kSlotAlignment;
+    }
+
+    static constexpr size_t kRememberedCapacity = 1024;
+    // Slots of the constant pool, a power of two kept at most half full.
+    static constexpr size_t kConstantCapacity = 1024;
+    static constexpr size_t kRootCapacity = 4096;
+    static constexpr size_t kFrameCapacity = 1024;
+    static constexpr size_t kDefaultStackLimit = 64 << 20;
+    // Cap on the native part of the budget, well within the default 8 MiB thread stack.
+    static constexpr size_t kNativeStackLimit = 4 << 20;
+    // Objects swept lazily per allocation.
+    static constexpr size_t kSweepBatch = 32;
+    static constexpr size_t kCachedNumberCount = kMaxCachedNumber - kMinCachedNumber;
+
+    // Redirects references to cells towards their copies, moving cells on first sight.
+    class CellMover : public Tracer {
+    public:
+        explicit CellMover(Heap* heap);
+
+        void Visit(ObjectPtr& ptr) override;
+
+    private:
+        Heap* heap_;
+    };
+
+    // Remembers the holder if it refers to an object allocated after marking.
+    class YoungFinder : public Tracer {
+    public:
+        YoungFinder(Heap* heap, ObjectPtr holder);
+
+        void Visit(ObjectPtr& ptr) override;
+
+    private:
+        Heap* heap_;
+        ObjectPtr holder_;
+    };
+
+    CellPtr Evacuate(CellPtr cell);
+    CellPtr MoveCell(CellPtr cell);
+
+    template <typename T, typename... Args>
+    T* Construct(Args&&... args) {
+        static_assert(sizeof(T) <= kMaxSlotSize, "Object is too big for the slab allocator");
+        static_assert(alignof(T) <= kSlotAlignment, "Object is overaligned");
+        constexpr uint8_t size_class = SizeClassOf(sizeof(T));
+        void* memory = Allocate(size_class);
+        T* object;
+        try {
+            object = new (memory) T(std::forward<Args>(args)...);
+        } catch (...) {
+            Deallocate(memory, size_class);
+            throw;
+        }
+        object->size_class_ = size_class;
+        return object;
+    }
+
+    template <typename T, typename... Args>
+    T* MakePermanent(Args&&... args) {
+        T* object = Construct<T>(std::forward<Args>(args)...);
+        object->old_ = true;
+        object->permanent_ = true;
+        object->heap_next_ = permanent_;
+        permanent_ = object;
+        return object;
+    }
+
+    static size_t HashConstant(ObjectPtr constant);
+
+    // Returns the slot of the constant pool holding a constant for which `equal` holds, or the
+    // empty slot where it belongs.
+    template <typename Equal>
+    size_t FindConstant(size_t hash, Equal equal) const;
+    // Returns the pooled constant for which `equal` holds, or pools the one returned by `make`.
+    template <typename Equal, typename Factory>
+    auto InternConstant(size_t hash, Equal equal, Factory make) -> decltype(make());
+    bool IsPooled(ObjectPtr object) const;
+    void RehashConstants(size_t capacity);
+    // Takes the constants left unmarked by marking out of the pool, old ones are kept after
+    // a minor collection. Must run before the mark bits are cleared.
+    void DropDeadConstants(bool young_only);
+    uint32_t TakeSymbolId();
+
+    inline void Safepoint() {
+        if (safepoints_ && allocated_since_safepoint_ >= kSafepointInterval) {
+            allocated_since_safepoint_ = 0;
+            safepoints_ = false;
+            collector_(false);
+            safepoints_ = true;
+        }
+    }
+
+    inline bool IsOverLimit(size_t bytes) const {
+        return (byte_limit_ && size_ + bytes > byte_limit_) ||
+               (object_limit_ && object_count_ >= object_limit_);
+    }
+
+    // Makes room for a new object of `bytes` within the limits.
+    inline void Reserve(size_t bytes) {
+        if (IsOverLimit(bytes)) {
+            CollectForLimit(bytes);
+        }
+    }
+
+    void CollectForLimit(size_t bytes);
+
+    // Moves the arena cursor to the next page, allocating one if there is none.
+    void NextArenaPage();
+
+    void* Allocate(uint8_t size_class);
+    void* AllocateFresh(uint8_t size_class);
+    void Deallocate(void* memory, uint8_t size_class);
+    void Erase(ObjectPtr ptr);
+    void PromoteSurvivors();
+    void ForgetRemembered();
+    // Sweeps up to `budget` set aside objects. Once the mutator has run since marking,
+    // promoted survivors may refer to new young objects and have to be remembered.
+    void SweepUnswept(size_t budget, bool remember_young);
+
+    ObjectPtr young_ = nullptr;
+    ObjectPtr old_ = nullptr;
+    ObjectPtr permanent_ = nullptr;
+    ObjectPtr unswept_young_ = nullptr;
+    ObjectPtr unswept_old_ = nullptr;
+    bool sweeping_ = false;
+    bool sweep_finished_ = false;
+    size_t swept_live_bytes_ = 0;
+    size_t swept_bytes_ = 0;
+    NumberPtr numbers_[kCachedNumberCount];
+    BooleanPtr true_ = nullptr;
+    BooleanPtr false_ = nullptr;
+    std::vector<ObjectPtr> constants_;
+    size_t constant_count_ = 0;
+    // Ids of dropped symbols are reused before new ones are taken.
+    std::vector<uint32_t> free_symbol_ids_;
+    uint32_t next_symbol_id_ = 0;
+    // Heap objects referred to from arena cells.
+    std::vector<ObjectPtr> arena_refs_;
+    std::vector<ObjectPtr> remembered_;
+    bool marking_ = false;
+    std::mutex mutation_mutex_;
+    std::vector<ObjectPtr> overwritten_;
+    std::vector<CellPtr> moved_;
+    std::vector<Root> roots_;
+    // Frames in use come first, followed by idle ones.
+    std::vector<ScopePtr> frames_;
+    size_t frame_depth_ = 0;
+    size_t stack_limit_ = kDefaultStackLimit;
+    size_t stack_size_ = 0;
+    const char* stack_base_ = nullptr;
+    std::function<void(bool emergency)> collector_;
+    bool safepoints_ = false;
+    size_t allocated_since_safepoint_ = 0;
+    size_t byte_limit_ = 0;
+    size_t object_limit_ = 0;
+    size_t size_ = 0;
+    size_t peak_size_ = 0;
+    size_t young_size_ = 0;
+    size_t object_count_ = 0;
+    Page* pages_ = nullptr;
+    // Pages of the arena in the order they are filled, up to the current one.
+    Page* arena_pages_ = nullptr;
+    Page* arena_page_ = nullptr;
+    char* arena_cursor_ = nullptr;
+    char* arena_end_ = nullptr;
+    SizeClass size_classes_[kSizeClassCount];
+};
+
+// Marks everything reachable from the given roots and the shadow stack on several threads.
+// Every worker owns a deque of marked objects whose references are not traced yet and steals
+// from the other workers' deques when its own one runs dry. Must only run while the mutator
+// is stopped.
+class ParallelMarker {
+public:
+    ParallelMarker(Heap* heap, size_t threads);
+
+    void Mark(const std::vector<ObjectPtr>& roots);
+
+private:
+    class Worker : public Tracer {
+    public:
+        Worker(ParallelMarker* marker, size_t index);
+
+        void Visit(ObjectPtr& ptr) override;
+        void Run();
+
+    private:
+        ObjectPtr Pop();
+        ObjectPtr Steal();
+
+        ParallelMarker* marker_;
+        size_t index_;
+    };
+
+    struct Deque {
+        std::mutex mutex;
+        std::deque<ObjectPtr> objects;
+    };
+
+    Heap* heap_;
+    std::vector<Deque> deques_;
+    // Objects marked but not traced yet, marking is over once it drops to zero.
+    std::atomic<size_t> pending_ = 0;
+};
+
+// Registers C++ locals referring to objects on the shadow stack of a heap, so that the
+// objects survive collections at safepoints. The locals are unregistered when the scope
+// is destroyed.
+class RootScope {
+public:
+    explicit RootScope(Heap& heap);
+    ~RootScope();
+
+    RootScope(const RootScope&) = delete;
+    RootScope& operator=(const RootScope&) = delete;
+
+    template <typename T>
+    void Add(T*& slot) {
+        heap_.roots_.push_back({&slot, &TraceSlot<T>});
+    }
+
+    void Add(std::vector<ObjectPtr>& slots);
+
+private:
+    template <typename T>
+    static void TraceSlot(const void* slot, Tracer* tracer) {
+        ObjectPtr ptr = *static_cast<T* const*>(slot);
+        tracer->Visit(ptr);
+    }
+
+    static void TraceSlots(const void* slots, Tracer* tracer);
+
+    Heap& heap_;
+    size_t depth_;
+};
+
+// Resets the arena of a heap when destroyed.
+class ArenaScope {
+public:
+    explicit ArenaScope(Heap& heap) : heap_(heap) {
+    }
+
+    ~ArenaScope() {
+        heap_.ResetArena();
+    }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+
+private:
+    Heap& heap_;
+};
+
+// Enables safepoints of a heap for its lifetime.
+class SafepointScope {
+public:
+    explicit SafepointScope(Heap& heap) : heap_(heap) {
+        heap_.EnableSafepoints(true);
+    }
+
+    ~SafepointScope() {
+        heap_.EnableSafepoints(false);
+    }
+
+private:
+    Heap& heap_;
+};
+
+// Guards a store of `value` over `old_value` into a field of `holder`,
+// must be alive until the store is done.
+class WriteBarrier {
+public:
+    inline WriteBarrier(ObjectPtr holder, ObjectPtr old_value, ObjectPtr value) {
+        Heap& heap = Heap::Of(holder);
+        heap.Remember(holder, value);
+        if (heap.marking_) {
+            lock_ = std::unique_lock(heap.mutation_mutex_);
+            if (old_value) {
+                heap.overwritten_.push_back(old_value);
+            }
+        }
+    }
+
+private:
+    std::unique_lock<std::mutex> lock_;
+};
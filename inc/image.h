@@ -0,0 +1,58 @@
+#pragma once
+
+#include "heap.h"
+#include "object.h"
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Heap images.
+// An image holds every object reachable from a global scope as a sequence of records, one
+// per object, where references are stored as record indices. Images are thus independent
+// of the addresses objects had, and loading one only allocates the objects and fixes up
+// their references, without parsing or evaluating anything. Builtin functions are stored
+// by type and replaced with fresh ones on load.
+
+class HeapImage {
+public:
+    static void Save(ScopePtr scope, std::ostream* out);
+    // Throws RuntimeError if the image is malformed.
+    static ScopePtr Load(Heap* heap, std::istream* in);
+
+private:
+    enum class Kind : uint8_t {
+        kNumber,
+        kBoolean,
+        kSymbol,
+        kCell,
+        kList,
+        kScope,
+        kLambda,
+        kBuiltin,
+    };
+
+    struct Record {
+        Kind kind;
+        // Scope a lambda was made in.
+        uint64_t scope = kNull;
+        int64_t value = 0;
+        std::string name;
+        std::vector<uint64_t> refs;
+        std::vector<std::string> names;
+        // Number of arguments among the references of a lambda, followed by its body.
+        uint64_t arg_count = 0;
+    };
+
+    static constexpr uint64_t kNull = UINT64_MAX;
+    static constexpr char kMagic[8] = {'S', 'C', 'M', 'I', 'M', 'G', '0', '1'};
+
+    static Record ReadRecord(std::istream* in);
+    static ObjectPtr Create(Heap* heap, const Record& record,
+                            const std::unordered_map<std::string, FunctionPtr>& builtins);
+    static void Fill(ObjectPtr object, const Record& record, const std::vector<ObjectPtr>& objects);
+};
@@ -3,12 +3,13 @@
 #include "error.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <string_view>
 #include <type_traits>
 #include <unordered_map>
-#include <unordered_set>
 #include <variant>
 #include <vector>
 
@@ -21,6 +22,8 @@ class List;
 class Cell;
 class Lambda;
 class Scope;
+class Heap;
+struct Code;
 
 using ObjectPtr = Object*;
 using FunctionPtr = Function*;
@@ -32,57 +35,132 @@ using CellPtr = Cell*;
 using LambdaPtr = Lambda*;
 using ScopePtr = Scope*;
 
-///////////////////////////////////////////////////////////////////////////////
-// Runtime type checking and convertion.
-// This can be helpful: https://en.cppreference.com/w/cpp/memory/shared_ptr/pointer_cast
+// Concrete type of an object, stored in its header. Subtypes of a class take consecutive
+// values, so that checking for a class compares against a single range.
+enum class ObjectType : uint8_t {
+    kNumber,
+    kBoolean,
+    kSymbol,
+    kCell,
+    kList,
+    kScope,
+    kBuiltin,
+    kLambda,
+};
 
-template <class T>
-T* As(ObjectPtr obj) {
-    T* res = dynamic_cast<T*>(obj);
-    if constexpr (std::is_same_v<Number, T>) {
-        if (!res) {
-            throw RuntimeError("RE!");
-        }
-    }
-    if (obj && !res) {
-        throw RuntimeError("RE!");
-    }
-    return res;
-}
+template <ObjectType First, ObjectType Last = First>
+struct TypeRange {
+    static constexpr ObjectType kFirst = First;
+    static constexpr ObjectType kLast = Last;
+};
 
+// Types an object can be checked for, others fail to compile.
 template <class T>
-bool Is(ObjectPtr obj) {
-    return dynamic_cast<T*>(obj) != nullptr;
-}
+struct TypeOf;
+
+template <>
+struct TypeOf<Object> : TypeRange<ObjectType::kNumber, ObjectType::kLambda> {};
+template <>
+struct TypeOf<Number> : TypeRange<ObjectType::kNumber> {};
+template <>
+struct TypeOf<Boolean> : TypeRange<ObjectType::kBoolean> {};
+template <>
+struct TypeOf<Symbol> : TypeRange<ObjectType::kSymbol> {};
+template <>
+struct TypeOf<Cell> : TypeRange<ObjectType::kCell> {};
+template <>
+struct TypeOf<List> : TypeRange<ObjectType::kList> {};
+template <>
+struct TypeOf<Scope> : TypeRange<ObjectType::kScope> {};
+template <>
+struct TypeOf<Function> : TypeRange<ObjectType::kBuiltin, ObjectType::kLambda> {};
+template <>
+struct TypeOf<Lambda> : TypeRange<ObjectType::kLambda> {};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// Visitor over the references an object holds, used by the garbage collector.
+// References are passed by slot, so that a moving collector can update them.
+class Tracer {
+public:
+    virtual ~Tracer() = default;
+    virtual void Visit(ObjectPtr& ptr) = 0;
+};
 
 ///////////////////////////////////////////////////////////////////////////////
 
-#define MakeNumber(x) Heap::GetInstance().Make<Number>().From(x)
-#define MakeBoolean(x) Heap::GetInstance().Make<Boolean>().From(x)
+#define MakeNumber(heap, x) (heap).GetNumber(x)
+#define MakeBoolean(heap, x) (heap).GetBoolean(x)
 
-class Object : public std::enable_shared_from_this<Object> {
+// The header of an object is its vtable, the link of the heap's live list, its type and
+// a few bits of the garbage collector.
+class Object {
 public:
-    // Object() = delete;
-    // Object(ScopePtr scope) : scope_(scope) {}
+    explicit Object(ObjectType type) : type_(type) {
+    }
+
     virtual ~Object() = default;
 
     virtual ObjectPtr Eval(ScopePtr working_scope) = 0;
     virtual std::string Serialize() = 0;
+    virtual void Trace(Tracer* tracer);
+    // Bytes owned by the object outside of its heap slot.
+    virtual size_t GetExternalSize() const;
 
-    inline ScopePtr GetScope() {
-        return scope_;
+    inline ObjectType GetType() const {
+        return type_;
     }
 
-    inline void SetScope(ScopePtr scope) {
-        scope_ = scope;
-    }
+private:
+    friend class Heap;
 
-protected:
-    ScopePtr scope_ = nullptr;
+    ObjectPtr heap_next_ = nullptr;
+    const ObjectType type_;
+    uint8_t size_class_ = 0;
+    std::atomic<bool> marked_ = false;
+    bool old_ = false;
+    bool remembered_ = false;
+    bool forwarded_ = false;
+    bool permanent_ = false;
+    bool arena_ = false;
 };
 
+///////////////////////////////////////////////////////////////////////////////
+// Runtime type checking and convertion.
+
+template <class T>
+bool Is(ObjectPtr obj) {
+    if constexpr (std::is_same_v<T, Object>) {
+        return obj != nullptr;
+    } else {
+        // Wraps around below the first type, so a range is checked with one comparison.
+        constexpr auto kFirst = static_cast<uint8_t>(TypeOf<T>::kFirst);
+        constexpr auto kLast = static_cast<uint8_t>(TypeOf<T>::kLast);
+        return obj && static_cast<uint8_t>(static_cast<uint8_t>(obj->GetType()) - kFirst) <=
+                          kLast - kFirst;
+    }
+}
+
+template <class T>
+T* As(ObjectPtr obj) {
+    if constexpr (std::is_same_v<Number, T>) {
+        if (!obj) {
+            throw RuntimeError("RE!");
+        }
+    }
+    if (obj && !Is<T>(obj)) {
+        throw RuntimeError("RE!");
+    }
+    return static_cast<T*>(obj);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
 class Function : public Object {
 public:
+    Function() : Object(ObjectType::kBuiltin) {
+    }
+
     virtual ObjectPtr Apply(std::vector<ObjectPtr> args, ScopePtr working_scope) = 0;
 
     ObjectPtr Eval(ScopePtr working_scope) override;
@@ -93,18 +171,19 @@ public:
     //    void SetWorkingScope(ScopePtr scope);
 
 protected:
+    explicit Function(ObjectType type) : Object(type) {
+    }
 };
 
 class FunctionFactory {
 public:
-    static FunctionFactory GetInstance();
+    explicit FunctionFactory(Heap* heap);
 
     FunctionPtr Get(const std::string& name);
 
     std::unordered_map<std::string, FunctionPtr>& GetAll();
 
 private:
-    FunctionFactory();
     FunctionFactory(FunctionFactory&) = delete;
     FunctionFactory(FunctionFactory&&) = delete;
     FunctionFactory& operator=(FunctionFactory) = delete;
@@ -270,6 +349,12 @@ public:
     ObjectPtr Apply(std::vector<ObjectPtr> args, ScopePtr working_scope) override;
 };
 
+// Whether both arguments evaluate to the same object.
+class Eq : public Function {
+public:
+    ObjectPtr Apply(std::vector<ObjectPtr> args, ScopePtr working_scope) override;
+};
+
 class ListFunction : public Function {
 public:
     ObjectPtr Apply(std::vector<ObjectPtr> args, ScopePtr working_scope) override;
@@ -317,7 +402,7 @@ public:
 
 class Number : public Object {
 public:
-    explicit Number(int64_t value) : value_(value) {
+    explicit Number(int64_t value) : Object(ObjectType::kNumber), value_(value) {
     }
 
     int64_t GetValue() const;
@@ -330,24 +415,33 @@ private:
     int64_t value_;
 };
 
+// Symbols are interned per heap, so that names are compared by pointer. Each also has a
+// dense id, which scopes use as the key of their bindings. The id of a collected symbol is
+// given to a later one.
 class Symbol : public Object {
 public:
-    explicit Symbol(std::string_view s) : name_(s) {
+    Symbol(std::string_view s, uint32_t id) : Object(ObjectType::kSymbol), id_(id), name_(s) {
     }
 
     const std::string& GetName() const;
 
+    inline uint32_t GetId() const {
+        return id_;
+    }
+
     ObjectPtr Eval(ScopePtr working_scope) override;
 
     std::string Serialize() override;
+    size_t GetExternalSize() const override;
 
 private:
+    uint32_t id_;
     std::string name_;
 };
 
 class Boolean : public Object {
 public:
-    explicit Boolean(bool value) : value_(value) {
+    explicit Boolean(bool value) : Object(ObjectType::kBoolean), value_(value) {
     }
 
     bool GetValue() const;
@@ -363,7 +457,7 @@ private:
 class List : public Object {
 public:
     List(const std::vector<ObjectPtr>& objects, bool is_proper)
-        : objects_(objects), is_proper_(is_proper) {
+        : Object(ObjectType::kList), objects_(objects), is_proper_(is_proper) {
     }
 
     std::vector<ObjectPtr> Get();
@@ -371,19 +465,25 @@ public:
     ObjectPtr Eval(ScopePtr working_scope) override;
 
     std::string Serialize() override;
+    void Trace(Tracer* tracer) override;
+    size_t GetExternalSize() const override;
 
     CellPtr ToCell();
 
 private:
+    friend class HeapImage;
+
     std::vector<ObjectPtr> objects_;
     bool is_proper_ = true;
 };
 
 class Cell : public Object {
 public:
-    Cell() = default;
+    Cell() : Object(ObjectType::kCell) {
+    }
     template <typename U, typename V>
-    Cell(U* f, V* s) : first_(As<Object>(f)), second_(As<Object>(s)) {
+    Cell(U* f, V* s)
+        : Object(ObjectType::kCell), first_(As<Object>(f)), second_(As<Object>(s)) {
     }
 
     ObjectPtr GetFirst();
@@ -395,10 +495,13 @@ public:
     ObjectPtr Eval(ScopePtr working_scope) override;
 
     std::string Serialize() override;
+    void Trace(Tracer* tracer) override;
 
     ListPtr ToList();
 
 private:
+    friend class Heap;
+
     ObjectPtr first_ = nullptr;
     ObjectPtr second_ = nullptr;
 };
@@ -407,88 +510,108 @@ void NoNullptr(std::vector<ObjectPtr> list);
 
 class Scope : public Object {
 public:
-    explicit Scope(ScopePtr parent = nullptr) : parent_(parent) {
+    explicit Scope(ScopePtr parent = nullptr) : Object(ObjectType::kScope), parent_(parent) {
     }
 
     ObjectPtr Eval(ScopePtr working_scope) override;
     std::string Serialize() override;
+    void Trace(Tracer* tracer) override;
+    size_t GetExternalSize() const override;
 
-    void Set(const std::string& name, ObjectPtr object);
-    void SetRec(const std::string& name, ObjectPtr object);
-    ObjectPtr Get(const std::string& name);
+    void Set(SymbolPtr name, ObjectPtr object);
+    void SetRec(SymbolPtr name, ObjectPtr object);
+    ObjectPtr Get(SymbolPtr name);
     ScopePtr GetParentScope();
 
     std::vector<ObjectPtr> GetAll();
 
+    // Binds the parameters of `owner` to `values`, one per parameter. Parameters are kept in
+    // slots indexed by their position, which compiled code reads without looking up names.
+    void Bind(LambdaPtr owner, const ObjectPtr* values);
+
+    inline ObjectPtr GetSlot(size_t index) const {
+        return slots_[index];
+    }
+
+    void SetSlot(size_t index, ObjectPtr object);
+
+    inline size_t GetSlotCount() const {
+        return slots_.size();
+    }
+
+    // Whether a name that is not a parameter was defined in the scope after it was made, which
+    // may shadow parameters of the scopes above it.
+    inline bool IsExtended() const {
+        return extended_;
+    }
+
+    // Forgets every binding and moves the scope under `parent`, so that it can serve another
+    // call as a frame.
+    void Reset(ScopePtr parent);
+
+    // Set once a lambda is made in the scope, which then must not be reused as a frame.
+    inline void Capture() {
+        captured_ = true;
+    }
+
+    inline bool IsCaptured() const {
+        return captured_;
+    }
+
 private:
+    friend class HeapImage;
+
+    // Returns the slot of the parameter `name`, or nullptr if there is none.
+    ObjectPtr* FindSlot(SymbolPtr name);
+
     ScopePtr parent_ = nullptr;
-    std::unordered_map<std::string, ObjectPtr> objects_;
+    bool captured_ = false;
+    bool extended_ = false;
+    // A binding keeps its name alive, so that the id it is keyed by is not given away.
+    struct Binding {
+        SymbolPtr name;
+        ObjectPtr value;
+    };
+
+    LambdaPtr owner_ = nullptr;
+    std::vector<ObjectPtr> slots_;
+    // Bindings by symbol id.
+    std::unordered_map<uint32_t, Binding> objects_;
 };
 
 class Lambda : public Function {
 public:
     Lambda(const std::vector<ObjectPtr>& args, const std::vector<ObjectPtr>& body);
+    ~Lambda() override;
 
     ObjectPtr Eval(ScopePtr working_scope) override;
 
     std::string Serialize() override;
+    void Trace(Tracer* tracer) override;
+    size_t GetExternalSize() const override;
 
     ObjectPtr Apply(std::vector<ObjectPtr> args, ScopePtr working_scope) override;
 
     std::vector<ObjectPtr> GetArgs();
     std::vector<ObjectPtr> GetBody();
 
-private:
-    std::vector<ObjectPtr> args_;
-    std::vector<ObjectPtr> body_;
-};
-
-class Heap {
-public:
-    inline ~Heap() {
-        for (ObjectPtr ptr : objects_) {
-            delete ptr;
-        }
-        objects_.clear();
-    }
-
-    template <typename T>
-    static auto Make() {
-        return Maker<T>();
-    }
-
-    static Heap& GetInstance() {
-        static Heap instance;
-        return instance;
-    }
-
-    inline std::unordered_set<ObjectPtr> GetObjects() {
-        return objects_;
+    // The scope the lambda was made in.
+    inline ScopePtr GetScope() {
+        return scope_;
     }
 
-    inline void Erase(ObjectPtr ptr) {
-        auto it = objects_.find(ptr);
-        if (it != objects_.end()) {
-            delete ptr;
-            objects_.erase(it);
-        }
-    }
+    void SetScope(ScopePtr scope);
 
 private:
-    template <typename T>
-    struct Maker {
-        template <typename... Args>
-        T* From(Args&&... args) {
-            if (!std::is_base_of_v<Object, T>) {
-                throw RuntimeError("Trying to create Object of wrong type!");
-            }
-            T* object = new T(std::forward<Args>(args)...);
-            GetInstance().objects_.insert(object);
-            return object;
-        }
-    };
-
-    Heap() = default;
+    friend class HeapImage;
+    friend class Scope;
+    friend class Vm;
 
-    std::unordered_set<ObjectPtr> objects_;
+    ScopePtr scope_ = nullptr;
+    // Compiled body, shared by the closures made from one lambda expression.
+    std::shared_ptr<Code> code_;
+    // Size of the code if the lambda compiled it, and thus accounts for it.
+    size_t code_size_ = 0;
+    std::vector<ObjectPtr> args_;
+    std::vector<ObjectPtr> body_;
 };
@@ -3,8 +3,10 @@
 #include <memory>
 #include <variant>
 
+#include "heap.h"
 #include "object.h"
 #include "tokenizer.h"
 
-ObjectPtr Read(Tokenizer* tokenizer);
-CellPtr ReadList(Tokenizer* tokenizer);
+// Code and quoted data are read into cells from the heap's arena.
+ObjectPtr Read(Tokenizer* tokenizer, Heap* heap);
+CellPtr ReadList(Tokenizer* tokenizer, Heap* heap);
@@ -1,11 +1,16 @@
 #pragma once
 
+#include "heap.h"
+#include "image.h"
 #include "parser.h"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <string>
 #include <sstream>
-#include <unordered_set>
+#include <thread>
+#include <vector>
 
 class Interpreter {
 public:
@@ -14,9 +19,101 @@ public:
 
     std::string Run(const std::string&);
 
+    // Runs a full collection regardless of the GC policy.
+    void CollectGarbage();
+
+    // Writes everything reachable from the global scope to a heap image file.
+    void SaveImage(const std::string& path);
+    // Replaces the global scope with the one stored in a heap image file.
+    void LoadImage(const std::string& path);
+
+    // Objects on the heap by type and the history of collections.
+    HeapStatistics HeapStats() const;
+
+    // Minimum heap size in bytes at which a collection is started after Run.
+    void SetGcThreshold(size_t bytes);
+    // After a collection the next one is due when the heap grows by this factor.
+    void SetGcGrowthFactor(double factor);
+    // Size of the young generation in bytes at which a minor collection is started after Run.
+    void SetGcNurserySize(size_t bytes);
+    // Number of threads marking the heap during stop-the-world full collections.
+    void SetGcThreads(size_t threads);
+    // Move live cells next to each other in list order during stop-the-world full collections.
+    void SetCompaction(bool enabled);
+    // Mark the heap on a background thread during full collections.
+    void SetConcurrentMarking(bool enabled);
+
+    // Limits on heap bytes and live objects, zero means no limit. Exceeding them raises
+    // OutOfMemory from Run.
+    void SetHeapLimit(size_t bytes);
+    void SetObjectLimit(size_t count);
+    // Limit on the bytes taken by the control stack of evaluation, zero means no limit.
+    // Recursion deeper than it allows raises RuntimeError from Run.
+    void SetStackLimit(size_t bytes);
+
 private:
-    void MarkDFS(ObjectPtr v, std::unordered_set<ObjectPtr>& marks);
-    void MarkAndSweep();
+    // Explicit worklist of marked objects whose references are not traced yet.
+    class MarkStack : public Tracer {
+    public:
+        explicit MarkStack(Heap* heap) : heap_(heap) {
+        }
+
+        void Visit(ObjectPtr& ptr) override;
+
+        // When set, old objects are neither marked nor traced.
+        inline void SetYoungOnly(bool young_only) {
+            young_only_ = young_only;
+        }
+
+        inline bool IsEmpty() const {
+            return stack_.empty();
+        }
 
+        inline ObjectPtr Pop() {
+            ObjectPtr ptr = stack_.back();
+            stack_.pop_back();
+            return ptr;
+        }
+
+    private:
+        Heap* heap_;
+        std::vector<ObjectPtr> stack_;
+        bool young_only_ = false;
+    };
+
+    // Runs a collection if the GC policy asks for one. Called after Run and at safepoints
+    // during evaluation, where cells must not be moved.
+    void CollectIfNeeded(bool allow_moving);
+    void CollectAll(bool allow_moving);
+
+    void MarkRoots();
+    void Drain();
+    // With `lazy` set, dead objects are erased on later allocations instead.
+    void MarkAndSweep(bool allow_moving, bool lazy);
+    void MarkAndSweepYoung();
+
+    void StartConcurrentMark();
+    void ConcurrentMark();
+    void FinishConcurrentMark(bool lazy);
+
+    void FinishSweep();
+    // Updates the GC policy and statistics once the pending sweep is over.
+    void RecordSweep();
+
+    // Declared first, so that it outlives every member referring to its objects.
+    Heap heap_;
     ScopePtr scope_ = nullptr;
+    MarkStack mark_stack_;
+    GcPolicy gc_policy_;
+    size_t gc_threads_ = 1;
+    bool compaction_ = false;
+
+    bool concurrent_marking_ = false;
+    std::thread marker_;
+    std::atomic<bool> marker_done_ = false;
+    MarkStack marker_stack_;
+    // Pause spent starting the running concurrent cycle.
+    std::chrono::nanoseconds start_pause_{0};
+
+    GcLog gc_log_;
 };
@@ -0,0 +1,215 @@
+#pragma once
+
+#include "heap.h"
+#include "object.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// Bytecode.
+// Lambda bodies and top-level expressions are compiled once into instructions for a stack
+// machine. Which builtin a call refers to is only known when the call runs, so every call
+// first evaluates its head. Calls to lambdas run in frames of the machine itself, calls to
+// builtins hand the unevaluated arguments to Function::Apply. Calls to the common builtins
+// are additionally compiled inline, behind a check that the head still evaluates to the
+// builtin the compiler saw.
+
+enum class Op : uint8_t {
+    // Pushes constants[arg].
+    kConstant,
+    // Pushes the value of the symbol constants[arg], throws NameError if it is unbound.
+    kLoad,
+    // Pushes the parameter in slot arg of the current frame, or the one at addresses[arg] of
+    // an enclosing frame. Both throw NameError if it is unbound, like kLoad.
+    kLoadLocal,
+    kLoadOuter,
+    // Pushes constants[arg] evaluated by the tree-walking evaluator.
+    kEval,
+    kPop,
+    kJump,
+    // Pops the condition and jumps to arg if it is #f.
+    kJumpIfFalse,
+    // Looks at the evaluated head of sites[arg] on top of the stack. A lambda stays there for
+    // the arguments to be evaluated, any other function is replaced with its result on the
+    // unevaluated arguments.
+    kCall,
+    // Pops the head of sites[arg] and goes on with the inlined code if it is the builtin the
+    // site was compiled for, otherwise applies it like kCall would, arguments included.
+    kInline,
+    // Calls the lambda below the top arg values.
+    kApply,
+    // Like kApply, but for a call whose value is returned right away. The callee takes over
+    // the frame of the caller, so that loops written as tail calls run in constant space.
+    kTailApply,
+    kReturn,
+    // Pushes a lambda made from prototypes[arg] in the current scope.
+    kClosure,
+    // Binds or assigns the symbol constants[arg] to the popped value and pushes ().
+    kDefine,
+    kSet,
+    // Assign the popped value to a parameter, addressed like kLoadLocal and kLoadOuter do.
+    kSetLocal,
+    kSetOuter,
+    // Throws RuntimeError unless the top value is a number.
+    kCheckNumber,
+    // Apply the arithmetic builtin of sites[arg] to one or two popped values.
+    kCollapse1,
+    kCollapse2,
+    // Applies the unary builtin of sites[arg] to the popped value.
+    kUnary,
+    kEqual,
+    kLess,
+    kGreater,
+    kNotLess,
+    kNotGreater,
+    kCar,
+    kCdr,
+    kCons,
+};
+
+struct Instruction {
+    Op op;
+    uint32_t arg = 0;
+};
+
+struct CallSite {
+    // The builtin inlined at the site, an index into the constants.
+    uint32_t builtin = 0;
+    // Unevaluated arguments, stored as consecutive constants.
+    uint32_t first_arg = 0;
+    uint32_t arg_count = 0;
+    // Where execution resumes once a builtin is applied.
+    uint32_t end = 0;
+};
+
+// A parameter of the frame `depth` levels up the scope chain. Its name is used instead
+// whenever a frame on the way defines new names, which may shadow the parameter.
+struct Address {
+    uint32_t depth = 0;
+    uint32_t slot = 0;
+    // The symbol, an index into the constants.
+    uint32_t name = 0;
+};
+
+struct Code;
+
+// A lambda expression compiled along with the code it appears in, so that the closures it
+// makes share their code. Parameters and body are stored as consecutive constants.
+struct Prototype {
+    uint32_t first_param = 0;
+    uint32_t param_count = 0;
+    uint32_t first_body = 0;
+    uint32_t body_count = 0;
+    std::shared_ptr<Code> code;
+};
+
+struct Code {
+    std::vector<Instruction> instructions;
+    // Every object the code refers to, traced by the owner of the code.
+    std::vector<ObjectPtr> constants;
+    std::vector<CallSite> sites;
+    std::vector<Prototype> prototypes;
+    std::vector<Address> addresses;
+    // Whether running the code may make a lambda capturing the scope it runs in.
+    bool may_capture_scope = false;
+
+    void Trace(Tracer* tracer);
+    size_t GetSize() const;
+};
+
+// Compiles expressions evaluated in `scope`, which is only used to find out which builtins
+// calls refer to. When the code is the body of a lambda, `params` lists the parameters of
+// the lambda and of the lambdas enclosing it, innermost first, which are then addressed by
+// their position instead of their name.
+class Compiler {
+public:
+    explicit Compiler(ScopePtr scope, std::vector<const std::vector<ObjectPtr>*> params = {})
+        : scope_(scope), params_(std::move(params)) {
+    }
+
+    // Evaluates the expressions in order and returns the value of the last one.
+    std::shared_ptr<Code> Compile(const std::vector<ObjectPtr>& body);
+
+private:
+    void CompileExpression(ObjectPtr expression);
+    void CompileCall(CellPtr form);
+    // Returns false if the form has to be applied as a plain call. Quoted data and lambda
+    // expressions read into the arena are left to the builtins, which move them into the heap
+    // first.
+    bool CompileInline(FunctionPtr builtin, uint32_t site, const std::vector<ObjectPtr>& args,
+                       bool in_arena);
+
+    uint32_t AddConstant(ObjectPtr object);
+    uint32_t AddSite(FunctionPtr builtin, const std::vector<ObjectPtr>& args);
+    uint32_t AddPrototype(const std::vector<ObjectPtr>& params,
+                          const std::vector<ObjectPtr>& body);
+    uint32_t Emit(Op op, uint32_t arg = 0);
+    uint32_t Here() const;
+    // Finds the parameter `symbol` refers to, returns false if it is not one.
+    bool Resolve(ObjectPtr symbol, Address* address) const;
+    // Emits `local` or `outer` for a parameter, `global` with the symbol otherwise.
+    void EmitVariable(ObjectPtr symbol, Op local, Op outer, Op global);
+
+    ScopePtr scope_;
+    std::vector<const std::vector<ObjectPtr>*> params_;
+    std::shared_ptr<Code> code_;
+};
+
+// Runs compiled code. A machine is made per evaluation from outside, lambdas called from
+// compiled code run on the same machine without growing the C++ stack. Its frames are charged
+// against the stack budget of the heap, so deep recursion fails with RuntimeError.
+class Vm {
+public:
+    explicit Vm(Heap& heap);
+    ~Vm();
+
+    Vm(const Vm&) = delete;
+    Vm& operator=(const Vm&) = delete;
+
+    ObjectPtr Run(ObjectPtr expression, ScopePtr scope);
+    ObjectPtr Call(LambdaPtr lambda, const std::vector<ObjectPtr>& args);
+
+    // Compiles the body of `lambda` unless it is compiled already.
+    static void Compile(LambdaPtr lambda);
+
+private:
+    struct Frame {
+        Code* code;
+        uint32_t pc;
+        // The lambda and the scope of the frame are kept on the stack at base and base + 1.
+        size_t base;
+        // Whether the scope was taken from the frame stack of the heap.
+        bool pooled;
+    };
+
+    // What a frame is charged against the stack budget: the frame itself, its scope and a few
+    // values on the stack.
+    static constexpr size_t kFrameBytes = sizeof(Frame) + sizeof(Scope) + 4 * sizeof(ObjectPtr);
+
+    // Replaces the lambda and the arguments on top of the stack with a frame.
+    void Enter(size_t argc);
+    void Leave();
+    // Moves the lambda and the arguments on top of the stack in place of the current frame.
+    void LeaveForTailCall(size_t argc);
+    void PopFrame();
+    ObjectPtr Execute();
+    // Applies `function` the way the tree-walking evaluator does.
+    ObjectPtr Apply(ObjectPtr function, const Code& code, const CallSite& site, ScopePtr scope);
+    // Returns the frame holding the parameter at `address`, or nullptr if it has to be found
+    // by name.
+    static ScopePtr FindFrame(ScopePtr scope, const Address& address);
+
+    inline ObjectPtr Pop() {
+        ObjectPtr object = stack_.back();
+        stack_.pop_back();
+        return object;
+    }
+
+    Heap& heap_;
+    RootScope roots_;
+    std::vector<ObjectPtr> stack_;
+    std::vector<Frame> frames_;
+};
@@ -8,6 +8,7 @@
 
 int main() {
     std::cout << "\nWelcome to Scheme Language Interpreter version 1.33.7!\n" << std::endl;
+    std::cout << "Type :heap to show heap statistics.\n" << std::endl;
     Interpreter interpreter;
     while (true) {
         std::cout << ">> ";
@@ -33,6 +34,11 @@ int main() {
             }
         }
 
+        if (req == ":heap") {
+            std::cout << interpreter.HeapStats().ToString() << "\n" << std::endl;
+            continue;
+        }
+
         try {
             std::string res = interpreter.Run(req);
             std::cout << res + "\n" << std::endl;
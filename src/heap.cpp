@@ -0,0 +1,771 @@
+#include "heap.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+#include <thread>
+
+void GcPolicy::SetThreshold(size_t bytes) {
+    threshold_ = bytes;
+    next_collection_ = bytes;
+}
+
+void GcPolicy::SetGrowthFactor(double factor) {
+    if (factor < 1.0) {
+        throw RuntimeError("GC growth factor must be at least 1");
+    }
+    growth_factor_ = factor;
+}
+
+size_t GcPolicy::GetThreshold() const {
+    return threshold_;
+}
+
+double GcPolicy::GetGrowthFactor() const {
+    return growth_factor_;
+}
+
+bool GcPolicy::ShouldCollect(size_t heap_bytes) const {
+    return heap_bytes >= next_collection_;
+}
+
+void GcPolicy::OnCollection(size_t live_bytes) {
+    next_collection_ = std::max(threshold_, static_cast<size_t>(live_bytes * growth_factor_));
+}
+
+void GcPolicy::SetNurserySize(size_t bytes) {
+    nursery_size_ = bytes;
+}
+
+size_t GcPolicy::GetNurserySize() const {
+    return nursery_size_;
+}
+
+bool GcPolicy::ShouldCollectYoung(size_t young_bytes) const {
+    return young_bytes >= nursery_size_;
+}
+
+namespace {
+
+void PrintTypeStatistics(std::ostream& out, const std::string& name,
+                         const HeapStatistics::TypeStatistics& stats) {
+    out << "  " << std::left << std::setw(8) << name << std::right << std::setw(10)
+        << stats.count << " objects " << std::setw(12) << stats.bytes << " bytes\n";
+}
+
+double ToMilliseconds(std::chrono::nanoseconds duration) {
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+// Finalizer of splitmix64, spreads the bits of aligned addresses over the whole hash.
+uint64_t Mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111eb;
+    x ^= x >> 31;
+    return x;
+}
+
+}  // namespace
+
+std::string HeapStatistics::ToString() const {
+    std::ostringstream out;
+    out << "objects:\n";
+    PrintTypeStatistics(out, "Number", numbers);
+    PrintTypeStatistics(out, "Cell", cells);
+    PrintTypeStatistics(out, "List", lists);
+    PrintTypeStatistics(out, "Scope", scopes);
+    PrintTypeStatistics(out, "Lambda", lambdas);
+    PrintTypeStatistics(out, "Symbol", symbols);
+    PrintTypeStatistics(out, "Other", others);
+    PrintTypeStatistics(out, "Constant", constants);
+    out << "heap: " << heap_bytes << " bytes, peak " << peak_heap_bytes << " bytes\n";
+    out << "collections: " << collections << " (" << minor_collections << " minor)\n";
+    out << "pauses: total " << ToMilliseconds(total_pause) << " ms, p50 "
+        << ToMilliseconds(p50_pause) << " ms, p99 " << ToMilliseconds(p99_pause) << " ms, max "
+        << ToMilliseconds(max_pause) << " ms\n";
+    out << "reclaimed: last " << last_reclaimed_bytes << " bytes, total "
+        << total_reclaimed_bytes << " bytes";
+    return out.str();
+}
+
+void GcLog::Record(std::chrono::nanoseconds pause, bool minor) {
+    pauses_[collections_ % kPauseHistory] = pause;
+    ++collections_;
+    if (minor) {
+        ++minor_collections_;
+    }
+    total_pause_ += pause;
+    max_pause_ = std::max(max_pause_, pause);
+}
+
+void GcLog::RecordReclaimed(size_t bytes) {
+    last_reclaimed_bytes_ = bytes;
+    total_reclaimed_bytes_ += bytes;
+}
+
+void GcLog::Fill(HeapStatistics* stats) const {
+    stats->collections = collections_;
+    stats->minor_collections = minor_collections_;
+    stats->total_pause = total_pause_;
+    stats->max_pause = max_pause_;
+    stats->last_reclaimed_bytes = last_reclaimed_bytes_;
+    stats->total_reclaimed_bytes = total_reclaimed_bytes_;
+
+    std::vector<std::chrono::nanoseconds> pauses(
+        pauses_.begin(), pauses_.begin() + std::min(collections_, kPauseHistory));
+    if (pauses.empty()) {
+        return;
+    }
+    auto percentile = [&pauses](size_t percent) {
+        auto it = pauses.begin() + (pauses.size() - 1) * percent / 100;
+        std::nth_element(pauses.begin(), it, pauses.end());
+        return *it;
+    };
+    stats->p50_pause = percentile(50);
+    stats->p99_pause = percentile(99);
+}
+
+Heap::Heap() {
+    remembered_.reserve(kRememberedCapacity);
+    roots_.reserve(kRootCapacity);
+    frames_.reserve(kFrameCapacity);
+    constants_.resize(kConstantCapacity);
+    for (size_t i = 0; i < kCachedNumberCount; ++i) {
+        numbers_[i] = MakePermanent<Number>(kMinCachedNumber + static_cast<int64_t>(i));
+    }
+    true_ = MakePermanent<Boolean>(true);
+    false_ = MakePermanent<Boolean>(false);
+}
+
+Heap::~Heap() {
+    for (ObjectPtr* list : {&young_, &old_, &unswept_young_, &unswept_old_, &permanent_}) {
+        while (*list) {
+            ObjectPtr next = (*list)->heap_next_;
+            (*list)->~Object();
+            *list = next;
+        }
+    }
+    for (Page** pages : {&pages_, &arena_pages_}) {
+        while (*pages) {
+            Page* next = (*pages)->next;
+            std::free(*pages);
+            *pages = next;
+        }
+    }
+}
+
+CellPtr Heap::MakeArenaCell(ObjectPtr first, ObjectPtr second) {
+    constexpr size_t kSize = SlotSize(SizeClassOf(sizeof(Cell)));
+    if (arena_cursor_ + kSize > arena_end_) {
+        NextArenaPage();
+    }
+    // Cells own nothing outside of their slot, so they are released without being destroyed.
+    CellPtr cell = new (arena_cursor_) Cell(first, second);
+    arena_cursor_ += kSize;
+    cell->size_class_ = SizeClassOf(sizeof(Cell));
+    cell->old_ = true;
+    cell->permanent_ = true;
+    cell->arena_ = true;
+    for (ObjectPtr part : {first, second}) {
+        if (part && !part->permanent_) {
+            arena_refs_.push_back(part);
+        }
+    }
+    return cell;
+}
+
+void Heap::NextArenaPage() {
+    Page* page = arena_page_ ? arena_page_->next : arena_pages_;
+    if (!page) {
+        void* memory = std::aligned_alloc(kPageSize, kPageSize);
+        if (!memory) {
+            throw std::bad_alloc();
+        }
+        page = new (memory) Page{nullptr, this};
+        if (arena_page_) {
+            arena_page_->next = page;
+        } else {
+            arena_pages_ = page;
+        }
+    }
+    arena_page_ = page;
+    arena_cursor_ = reinterpret_cast<char*>(page) + sizeof(Page);
+    arena_end_ = reinterpret_cast<char*>(page) + kPageSize;
+}
+
+ObjectPtr Heap::Promote(ObjectPtr object) {
+    if (!object || !object->arena_) {
+        return object;
+    }
+    // Walks the cdr chain iteratively, so that long lists do not recurse deeply.
+    CheckNativeStack();
+    RootScope roots(*this);
+    CellPtr head = nullptr;
+    roots.Add(head);
+    CellPtr tail = nullptr;
+    roots.Add(tail);
+    ObjectPtr first = nullptr;
+    roots.Add(first);
+    ObjectPtr next = object;
+    while (next && next->arena_) {
+        CellPtr cell = As<Cell>(next);
+        first = Promote(cell->first_);
+        CellPtr copy = Make<Cell>().From(first, ObjectPtr(nullptr));
+        if (tail) {
+            tail->SetSecond(copy);
+        } else {
+            head = copy;
+        }
+        tail = copy;
+        next = cell->second_;
+    }
+    tail->SetSecond(next);
+    return head;
+}
+
+void Heap::ResetArena() {
+    arena_refs_.clear();
+    if (!arena_pages_) {
+        return;
+    }
+    // Objects which are waiting to be swept or traced by the marking thread may still refer to
+    // released cells, so their pages are kept and refilled with cells until that is over.
+    if (!marking_ && !sweeping_) {
+        while (arena_pages_->next) {
+            Page* next = arena_pages_->next->next;
+            std::free(arena_pages_->next);
+            arena_pages_->next = next;
+        }
+    }
+    arena_page_ = nullptr;
+    NextArenaPage();
+}
+
+NumberPtr Heap::InternNumber(int64_t value) {
+    if (value >= kMinCachedNumber && value < kMaxCachedNumber) {
+        return numbers_[value - kMinCachedNumber];
+    }
+    auto equal = [value](ObjectPtr constant) {
+        return Is<Number>(constant) && As<Number>(constant)->GetValue() == value;
+    };
+    return InternConstant(Mix(value), equal, [this, value] { return Make<Number>().From(value); });
+}
+
+SymbolPtr Heap::InternSymbol(const std::string& name) {
+    auto equal = [&name](ObjectPtr constant) {
+        return Is<Symbol>(constant) && As<Symbol>(constant)->GetName() == name;
+    };
+    return InternConstant(std::hash<std::string>()(name), equal,
+                          [this, &name] { return Make<Symbol>().From(name, TakeSymbolId()); });
+}
+
+uint32_t Heap::TakeSymbolId() {
+    if (free_symbol_ids_.empty()) {
+        return next_symbol_id_++;
+    }
+    uint32_t id = free_symbol_ids_.back();
+    free_symbol_ids_.pop_back();
+    return id;
+}
+
+size_t Heap::HashConstant(ObjectPtr constant) {
+    if (Is<Symbol>(constant)) {
+        return std::hash<std::string>()(As<Symbol>(constant)->GetName());
+    }
+    return Mix(As<Number>(constant)->GetValue());
+}
+
+template <typename Equal>
+size_t Heap::FindConstant(size_t hash, Equal equal) const {
+    size_t mask = constants_.size() - 1;
+    size_t index = hash & mask;
+    while (constants_[index] && !equal(constants_[index])) {
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+template <typename Equal, typename Factory>
+auto Heap::InternConstant(size_t hash, Equal equal, Factory make) -> decltype(make()) {
+    size_t index = FindConstant(hash, equal);
+    if (constants_[index]) {
+        // The constant may have been unreachable when marking started, the marker has to learn
+        // that it is in use again.
+        if (marking_) {
+            Mark(constants_[index]);
+        }
+        return static_cast<decltype(make())>(constants_[index]);
+    }
+    auto constant = make();
+    // Making the constant may have collected garbage and dropped constants, moving the slot.
+    constants_[FindConstant(hash, equal)] = constant;
+    if (++constant_count_ * 2 > constants_.size()) {
+        RehashConstants(constants_.size() * 2);
+    }
+    return constant;
+}
+
+bool Heap::IsPooled(ObjectPtr object) const {
+    auto same = [object](ObjectPtr constant) { return constant == object; };
+    return constants_[FindConstant(HashConstant(object), same)] != nullptr;
+}
+
+void Heap::RehashConstants(size_t capacity) {
+    std::vector<ObjectPtr> constants(capacity);
+    constants.swap(constants_);
+    for (ObjectPtr constant : constants) {
+        if (constant) {
+            constants_[FindConstant(HashConstant(constant), [](ObjectPtr) { return false; })] =
+                constant;
+        }
+    }
+}
+
+void Heap::DropDeadConstants(bool young_only) {
+    size_t count = constant_count_;
+    for (ObjectPtr& constant : constants_) {
+        if (!constant || constant->marked_.load(std::memory_order_relaxed) ||
+            (young_only && constant->old_)) {
+            continue;
+        }
+        if (Is<Symbol>(constant)) {
+            free_symbol_ids_.push_back(As<Symbol>(constant)->GetId());
+        }
+        constant = nullptr;
+        --constant_count_;
+    }
+    if (constant_count_ == count) {
+        return;
+    }
+    // Holes break the probe sequences, so the pool is rebuilt, shrinking once it is sparse.
+    size_t capacity = constants_.size();
+    while (capacity > kConstantCapacity && constant_count_ * 8 < capacity) {
+        capacity /= 2;
+    }
+    RehashConstants(capacity);
+}
+
+void Heap::StartMarking() {
+    marking_ = true;
+}
+
+void Heap::FinishMarking() {
+    marking_ = false;
+}
+
+void Heap::DrainOverwritten(Tracer* tracer) {
+    for (ObjectPtr ptr : overwritten_) {
+        tracer->Visit(ptr);
+    }
+    overwritten_.clear();
+}
+
+void Heap::CompactCells() {
+    CellMover mover(this);
+    for (ObjectPtr list : {young_, old_}) {
+        for (ObjectPtr object = list; object; object = object->heap_next_) {
+            if (object->marked_.load(std::memory_order_relaxed) && !Is<Cell>(object)) {
+                object->Trace(&mover);
+            }
+        }
+    }
+    for (size_t i = 0; i < moved_.size(); ++i) {
+        mover.Visit(moved_[i]->first_);
+        mover.Visit(moved_[i]->second_);
+    }
+    moved_.clear();
+}
+
+Heap::CellMover::CellMover(Heap* heap) : heap_(heap) {
+}
+
+void Heap::CellMover::Visit(ObjectPtr& ptr) {
+    if (!ptr || ptr->permanent_ || !Is<Cell>(ptr)) {
+        return;
+    }
+    CellPtr cell = As<Cell>(ptr);
+    ptr = cell->forwarded_ ? As<Cell>(cell->first_) : heap_->Evacuate(cell);
+}
+
+// Copies `cell` together with the not yet moved part of its cdr chain. References held by
+// the copies still lead to the original cells, the caller fixes them up through `moved_`.
+CellPtr Heap::Evacuate(CellPtr cell) {
+    CellPtr head = MoveCell(cell);
+    ObjectPtr next = head->second_;
+    while (Is<Cell>(next) && !next->forwarded_ && !next->permanent_) {
+        next = MoveCell(As<Cell>(next))->second_;
+    }
+    return head;
+}
+
+CellPtr Heap::MoveCell(CellPtr cell) {
+    void* memory = AllocateFresh(cell->size_class_);
+    CellPtr copy = new (memory) Cell(cell->first_, cell->second_);
+    copy->size_class_ = cell->size_class_;
+    copy->marked_.store(true, std::memory_order_relaxed);
+    copy->old_ = true;
+    copy->heap_next_ = old_;
+    old_ = copy;
+    size_ += SlotSize(copy->size_class_);
+    peak_size_ = std::max(peak_size_, size_);
+    ++object_count_;
+    moved_.push_back(copy);
+
+    cell->first_ = copy;
+    cell->forwarded_ = true;
+    cell->marked_.store(false, std::memory_order_relaxed);
+    return copy;
+}
+
+void Heap::CountObjects(HeapStatistics* stats) const {
+    for (ObjectPtr list : {young_, old_, unswept_young_, unswept_old_}) {
+        for (ObjectPtr object = list; object; object = object->heap_next_) {
+            HeapStatistics::TypeStatistics* type = &stats->others;
+            if ((Is<Number>(object) || Is<Symbol>(object)) && IsPooled(object)) {
+                type = &stats->constants;
+            } else if (Is<Number>(object)) {
+                type = &stats->numbers;
+            } else if (Is<Cell>(object)) {
+                type = &stats->cells;
+            } else if (Is<List>(object)) {
+                type = &stats->lists;
+            } else if (Is<Scope>(object)) {
+                type = &stats->scopes;
+            } else if (Is<Lambda>(object)) {
+                type = &stats->lambdas;
+            } else if (Is<Symbol>(object)) {
+                type = &stats->symbols;
+            }
+            ++type->count;
+            type->bytes += SlotSize(object->size_class_) + object->GetExternalSize();
+        }
+    }
+    stats->heap_bytes = size_;
+    stats->peak_heap_bytes = peak_size_;
+}
+
+void Heap::SetCollector(std::function<void(bool emergency)> collector) {
+    collector_ = std::move(collector);
+}
+
+void Heap::SetByteLimit(size_t bytes) {
+    byte_limit_ = bytes;
+}
+
+void Heap::SetObjectLimit(size_t count) {
+    object_limit_ = count;
+}
+
+void Heap::CollectForLimit(size_t bytes) {
+    if (safepoints_) {
+        safepoints_ = false;
+        collector_(true);
+        safepoints_ = true;
+    }
+    if (IsOverLimit(bytes)) {
+        throw OutOfMemory("Heap limit exceeded");
+    }
+}
+
+void Heap::TraceRoots(Tracer* tracer) {
+    for (const Root& root : roots_) {
+        root.trace(root.slot, tracer);
+    }
+    for (ScopePtr frame : frames_) {
+        ObjectPtr ptr = frame;
+        tracer->Visit(ptr);
+    }
+    for (ObjectPtr ptr : arena_refs_) {
+        tracer->Visit(ptr);
+    }
+}
+
+ScopePtr Heap::PushFrame(ScopePtr parent) {
+    if (frame_depth_ < frames_.size()) {
+        frames_[frame_depth_]->Reset(parent);
+    } else {
+        frames_.push_back(Make<Scope>().From(parent));
+    }
+    return frames_[frame_depth_++];
+}
+
+void Heap::PopFrame() {
+    ScopePtr frame = frames_[--frame_depth_];
+    if (frame->IsCaptured()) {
+        frames_[frame_depth_] = frames_.back();
+        frames_.pop_back();
+    } else {
+        frame->Reset(nullptr);
+    }
+}
+
+void Heap::ReleaseIdleFrames() {
+    frames_.resize(frame_depth_);
+}
+
+void Heap::SetStackLimit(size_t bytes) {
+    stack_limit_ = bytes;
+}
+
+void Heap::ReserveStack(size_t bytes) {
+    if (stack_limit_ && stack_size_ + bytes > stack_limit_) {
+        throw RuntimeError("Stack overflow");
+    }
+    stack_size_ += bytes;
+}
+
+void Heap::ReleaseStack(size_t bytes) {
+    stack_size_ -= bytes;
+}
+
+void Heap::SetStackBase(const void* base) {
+    stack_base_ = static_cast<const char*>(base);
+}
+
+void Heap::CheckNativeStack() const {
+    // The stack grows down. A frame above the base belongs to a caller outside of evaluation.
+    auto top = static_cast<const char*>(__builtin_frame_address(0));
+    if (!stack_base_ || top >= stack_base_) {
+        return;
+    }
+    size_t native = stack_base_ - top;
+    if (native > kNativeStackLimit || (stack_limit_ && stack_size_ + native > stack_limit_)) {
+        throw RuntimeError("Stack overflow");
+    }
+}
+
+void Heap::Sweep() {
+    StartSweep();
+    SweepUnswept(SIZE_MAX, false);
+}
+
+void Heap::StartSweep() {
+    DropDeadConstants(false);
+    ForgetRemembered();
+    unswept_young_ = young_;
+    unswept_old_ = old_;
+    young_ = nullptr;
+    old_ = nullptr;
+    young_size_ = 0;
+    swept_live_bytes_ = 0;
+    swept_bytes_ = 0;
+    sweeping_ = true;
+    sweep_finished_ = false;
+}
+
+void Heap::FinishSweep() {
+    SweepUnswept(SIZE_MAX, true);
+}
+
+bool Heap::TakeSweepResult(size_t* live_bytes, size_t* reclaimed_bytes) {
+    if (!sweep_finished_) {
+        return false;
+    }
+    sweep_finished_ = false;
+    *live_bytes = swept_live_bytes_;
+    *reclaimed_bytes = swept_bytes_;
+    return true;
+}
+
+void Heap::SweepUnswept(size_t budget, bool remember_young) {
+    for (; budget > 0 && (unswept_young_ || unswept_old_); --budget) {
+        ObjectPtr* list = unswept_young_ ? &unswept_young_ : &unswept_old_;
+        ObjectPtr object = *list;
+        *list = object->heap_next_;
+        size_t size = SlotSize(object->size_class_) + object->GetExternalSize();
+        if (!object->marked_.load(std::memory_order_relaxed)) {
+            swept_bytes_ += size;
+            Erase(object);
+            continue;
+        }
+        swept_live_bytes_ += size;
+        object->marked_.store(false, std::memory_order_relaxed);
+        if (!object->old_) {
+            object->old_ = true;
+            if (remember_young) {
+                YoungFinder finder(this, object);
+                object->Trace(&finder);
+            }
+        }
+        object->heap_next_ = old_;
+        old_ = object;
+    }
+    if (!unswept_young_ && !unswept_old_ && sweeping_) {
+        sweeping_ = false;
+        sweep_finished_ = true;
+    }
+}
+
+Heap::YoungFinder::YoungFinder(Heap* heap, ObjectPtr holder) : heap_(heap), holder_(holder) {
+}
+
+void Heap::YoungFinder::Visit(ObjectPtr& ptr) {
+    // Survivors still waiting to be swept are marked and become old soon.
+    if (ptr && !ptr->old_ && !ptr->marked_.load(std::memory_order_relaxed)) {
+        heap_->Remember(holder_, ptr);
+    }
+}
+
+void Heap::SweepYoung() {
+    DropDeadConstants(true);
+    PromoteSurvivors();
+    ForgetRemembered();
+}
+
+void Heap::PromoteSurvivors() {
+    while (young_) {
+        ObjectPtr object = young_;
+        young_ = object->heap_next_;
+        if (object->marked_.load(std::memory_order_relaxed)) {
+            object->marked_.store(false, std::memory_order_relaxed);
+            object->old_ = true;
+            object->heap_next_ = old_;
+            old_ = object;
+        } else {
+            Erase(object);
+        }
+    }
+    young_size_ = 0;
+}
+
+void Heap::ForgetRemembered() {
+    for (ObjectPtr object : remembered_) {
+        object->remembered_ = false;
+    }
+    remembered_.clear();
+}
+
+void* Heap::Allocate(uint8_t size_class) {
+    SizeClass& slots = size_classes_[size_class];
+    if (slots.free) {
+        FreeSlot* slot = slots.free;
+        slots.free = slot->next;
+        return slot;
+    }
+    return AllocateFresh(size_class);
+}
+
+void* Heap::AllocateFresh(uint8_t size_class) {
+    SizeClass& slots = size_classes_[size_class];
+    size_t slot_size = SlotSize(size_class);
+    if (slots.cursor + slot_size > slots.end) {
+        void* memory = std::aligned_alloc(kPageSize, kPageSize);
+        if (!memory) {
+            throw std::bad_alloc();
+        }
+        Page* page = new (memory) Page{pages_, this};
+        pages_ = page;
+        slots.cursor = static_cast<char*>(memory) + sizeof(Page);
+        slots.end = static_cast<char*>(memory) + kPageSize;
+    }
+    void* memory = slots.cursor;
+    slots.cursor += slot_size;
+    return memory;
+}
+
+void Heap::Deallocate(void* memory, uint8_t size_class) {
+    SizeClass& slots = size_classes_[size_class];
+    slots.free = new (memory) FreeSlot{slots.free};
+}
+
+void Heap::Erase(ObjectPtr ptr) {
+    uint8_t size_class = ptr->size_class_;
+    size_ -= SlotSize(size_class) + ptr->GetExternalSize();
+    --object_count_;
+    ptr->~Object();
+    Deallocate(ptr, size_class);
+}
+
+RootScope::RootScope(Heap& heap) : heap_(heap), depth_(heap.roots_.size()) {
+}
+
+RootScope::~RootScope() {
+    heap_.roots_.resize(depth_);
+}
+
+void RootScope::Add(std::vector<ObjectPtr>& slots) {
+    heap_.roots_.push_back({&slots, &TraceSlots});
+}
+
+void RootScope::TraceSlots(const void* slots, Tracer* tracer) {
+    for (ObjectPtr ptr : *static_cast<const std::vector<ObjectPtr>*>(slots)) {
+        tracer->Visit(ptr);
+    }
+}
+
+ParallelMarker::ParallelMarker(Heap* heap, size_t threads)
+    : heap_(heap), deques_(std::max<size_t>(threads, 1)) {
+}
+
+void ParallelMarker::Mark(const std::vector<ObjectPtr>& roots) {
+    Worker main_worker(this, 0);
+    for (ObjectPtr root : roots) {
+        main_worker.Visit(root);
+    }
+    heap_->TraceRoots(&main_worker);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < deques_.size(); ++i) {
+        threads.emplace_back([this, i] { Worker(this, i).Run(); });
+    }
+    main_worker.Run();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+ParallelMarker::Worker::Worker(ParallelMarker* marker, size_t index)
+    : marker_(marker), index_(index) {
+}
+
+void ParallelMarker::Worker::Visit(ObjectPtr& ptr) {
+    if (!ptr || !marker_->heap_->Mark(ptr)) {
+        return;
+    }
+    marker_->pending_.fetch_add(1);
+    Deque& deque = marker_->deques_[index_];
+    std::lock_guard lock(deque.mutex);
+    deque.objects.push_back(ptr);
+}
+
+void ParallelMarker::Worker::Run() {
+    while (marker_->pending_.load() != 0) {
+        ObjectPtr ptr = Pop();
+        if (!ptr) {
+            ptr = Steal();
+        }
+        if (!ptr) {
+            std::this_thread::yield();
+            continue;
+        }
+        ptr->Trace(this);
+        marker_->pending_.fetch_sub(1);
+    }
+}
+
+ObjectPtr ParallelMarker::Worker::Pop() {
+    Deque& deque = marker_->deques_[index_];
+    std::lock_guard lock(deque.mutex);
+    if (deque.objects.empty()) {
+        return nullptr;
+    }
+    ObjectPtr ptr = deque.objects.back();
+    deque.objects.pop_back();
+    return ptr;
+}
+
+ObjectPtr ParallelMarker::Worker::Steal() {
+    size_t count = marker_->deques_.size();
+    for (size_t i = 1; i < count; ++i) {
+        Deque& deque = marker_->deques_[(index_ + i) % count];
+        std::lock_guard lock(deque.mutex);
+        if (!deque.objects.empty()) {
+            ObjectPtr ptr = deque.objects.front();
+            deque.objects.pop_front();
+            return ptr;
+        }
+    }
+    return nullptr;
+}
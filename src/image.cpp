@@ -0,0 +1,281 @@
+#include "image.h"
+
+#include <algorithm>
+#include <sstream>
+#include <typeinfo>
+#include <unordered_map>
+
+namespace {
+
+void WriteU64(std::ostream* out, uint64_t value) {
+    out->write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void WriteString(std::ostream* out, const std::string& s) {
+    WriteU64(out, s.size());
+    out->write(s.data(), static_cast<std::streamsize>(s.size()));
+}
+
+uint64_t ReadU64(std::istream* in) {
+    uint64_t value;
+    if (!in->read(reinterpret_cast<char*>(&value), sizeof(value))) {
+        throw RuntimeError("Invalid heap image");
+    }
+    return value;
+}
+
+std::string ReadString(std::istream* in) {
+    uint64_t size = ReadU64(in);
+    std::string s;
+    // Grows along with the data actually read, so a corrupted size fails cleanly.
+    char buffer[4096];
+    while (size > 0) {
+        size_t chunk = std::min<uint64_t>(size, sizeof(buffer));
+        if (!in->read(buffer, static_cast<std::streamsize>(chunk))) {
+            throw RuntimeError("Invalid heap image");
+        }
+        s.append(buffer, chunk);
+        size -= chunk;
+    }
+    return s;
+}
+
+}  // namespace
+
+void HeapImage::Save(ScopePtr scope, std::ostream* out) {
+    std::unordered_map<ObjectPtr, uint64_t> indices;
+    std::vector<ObjectPtr> objects;
+    auto index = [&indices, &objects](ObjectPtr object) {
+        if (!object) {
+            return kNull;
+        }
+        auto [it, inserted] = indices.emplace(object, objects.size());
+        if (inserted) {
+            objects.push_back(object);
+        }
+        return it->second;
+    };
+    index(scope);
+
+    // Objects are discovered while their referrers are written, so the count is only known
+    // at the end.
+    std::ostringstream records;
+    for (size_t i = 0; i < objects.size(); ++i) {
+        ObjectPtr object = objects[i];
+        Record record;
+        if (Is<Number>(object)) {
+            record.kind = Kind::kNumber;
+            record.value = As<Number>(object)->GetValue();
+        } else if (Is<Boolean>(object)) {
+            record.kind = Kind::kBoolean;
+            record.value = As<Boolean>(object)->GetValue();
+        } else if (Is<Symbol>(object)) {
+            record.kind = Kind::kSymbol;
+            record.name = As<Symbol>(object)->GetName();
+        } else if (Is<Cell>(object)) {
+            record.kind = Kind::kCell;
+            record.refs = {index(As<Cell>(object)->GetFirst()),
+                           index(As<Cell>(object)->GetSecond())};
+        } else if (Is<List>(object)) {
+            ListPtr list = As<List>(object);
+            record.kind = Kind::kList;
+            record.value = list->is_proper_;
+            for (ObjectPtr ptr : list->objects_) {
+                record.refs.push_back(index(ptr));
+            }
+        } else if (Is<Scope>(object)) {
+            ScopePtr scope = As<Scope>(object);
+            record.kind = Kind::kScope;
+            record.refs.push_back(index(scope->parent_));
+            // Parameters are written as named bindings, later ones shadowing repeated names.
+            for (size_t j = 0; j < scope->slots_.size(); ++j) {
+                SymbolPtr param = As<Symbol>(scope->owner_->args_[j]);
+                if (scope->FindSlot(param) == &scope->slots_[j]) {
+                    record.names.push_back(param->GetName());
+                    record.refs.push_back(index(scope->slots_[j]));
+                }
+            }
+            for (auto& [id, binding] : scope->objects_) {
+                record.names.push_back(binding.name->GetName());
+                record.refs.push_back(index(binding.value));
+            }
+        } else if (Is<Lambda>(object)) {
+            LambdaPtr lambda = As<Lambda>(object);
+            record.kind = Kind::kLambda;
+            record.scope = index(lambda->scope_);
+            record.arg_count = lambda->args_.size();
+            for (ObjectPtr ptr : lambda->args_) {
+                record.refs.push_back(index(ptr));
+            }
+            for (ObjectPtr ptr : lambda->body_) {
+                record.refs.push_back(index(ptr));
+            }
+        } else if (Is<Function>(object)) {
+            record.kind = Kind::kBuiltin;
+            record.name = typeid(*object).name();
+        } else {
+            throw RuntimeError("Object can not be saved to a heap image");
+        }
+
+        records.put(static_cast<char>(record.kind));
+        WriteU64(&records, record.scope);
+        WriteU64(&records, static_cast<uint64_t>(record.value));
+        WriteString(&records, record.name);
+        WriteU64(&records, record.arg_count);
+        WriteU64(&records, record.refs.size());
+        for (uint64_t ref : record.refs) {
+            WriteU64(&records, ref);
+        }
+        WriteU64(&records, record.names.size());
+        for (const std::string& name : record.names) {
+            WriteString(&records, name);
+        }
+    }
+
+    out->write(kMagic, sizeof(kMagic));
+    WriteU64(out, objects.size());
+    *out << records.str();
+    if (!*out) {
+        throw RuntimeError("Failed to write heap image");
+    }
+}
+
+ScopePtr HeapImage::Load(Heap* heap, std::istream* in) {
+    char magic[sizeof(kMagic)];
+    if (!in->read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), kMagic)) {
+        throw RuntimeError("Invalid heap image");
+    }
+    uint64_t count = ReadU64(in);
+    std::vector<Record> records;
+    for (uint64_t i = 0; i < count; ++i) {
+        records.push_back(ReadRecord(in));
+    }
+    if (records.empty() || records.front().kind != Kind::kScope) {
+        throw RuntimeError("Invalid heap image");
+    }
+
+    FunctionFactory factory(heap);
+    std::unordered_map<std::string, FunctionPtr> builtins;
+    for (auto& [name, function] : factory.GetAll()) {
+        builtins.emplace(typeid(*function).name(), function);
+    }
+
+    std::vector<ObjectPtr> objects;
+    objects.reserve(records.size());
+    for (const Record& record : records) {
+        objects.push_back(Create(heap, record, builtins));
+    }
+    for (size_t i = 0; i < objects.size(); ++i) {
+        Fill(objects[i], records[i], objects);
+    }
+    return As<Scope>(objects.front());
+}
+
+HeapImage::Record HeapImage::ReadRecord(std::istream* in) {
+    int kind = in->get();
+    if (kind < static_cast<int>(Kind::kNumber) || kind > static_cast<int>(Kind::kBuiltin)) {
+        throw RuntimeError("Invalid heap image");
+    }
+    Record record;
+    record.kind = static_cast<Kind>(kind);
+    record.scope = ReadU64(in);
+    record.value = static_cast<int64_t>(ReadU64(in));
+    record.name = ReadString(in);
+    record.arg_count = ReadU64(in);
+    for (uint64_t i = ReadU64(in); i > 0; --i) {
+        record.refs.push_back(ReadU64(in));
+    }
+    for (uint64_t i = ReadU64(in); i > 0; --i) {
+        record.names.push_back(ReadString(in));
+    }
+    return record;
+}
+
+ObjectPtr HeapImage::Create(Heap* heap, const Record& record,
+                            const std::unordered_map<std::string, FunctionPtr>& builtins) {
+    switch (record.kind) {
+        case Kind::kNumber:
+            return heap->InternNumber(record.value);
+        case Kind::kBoolean:
+            return MakeBoolean(*heap, record.value != 0);
+        case Kind::kSymbol:
+            return heap->InternSymbol(record.name);
+        case Kind::kCell:
+            if (record.refs.size() != 2) {
+                throw RuntimeError("Invalid heap image");
+            }
+            return heap->Make<Cell>().From();
+        case Kind::kList:
+            return heap->Make<List>().From(std::vector<ObjectPtr>(record.refs.size()),
+                                           record.value != 0);
+        case Kind::kScope:
+            if (record.refs.size() != record.names.size() + 1) {
+                throw RuntimeError("Invalid heap image");
+            }
+            return heap->Make<Scope>().From();
+        case Kind::kLambda:
+            if (record.arg_count > record.refs.size()) {
+                throw RuntimeError("Invalid heap image");
+            }
+            return heap->Make<Lambda>().From(
+                std::vector<ObjectPtr>(record.arg_count),
+                std::vector<ObjectPtr>(record.refs.size() - record.arg_count));
+        case Kind::kBuiltin: {
+            auto it = builtins.find(record.name);
+            if (it == builtins.end()) {
+                throw RuntimeError("Unknown builtin in heap image");
+            }
+            return it->second;
+        }
+    }
+    throw RuntimeError("Invalid heap image");
+}
+
+// Lists, lambdas and scopes were just made, so their slots are filled without write barriers.
+void HeapImage::Fill(ObjectPtr object, const Record& record,
+                     const std::vector<ObjectPtr>& objects) {
+    auto at = [&objects](uint64_t index) -> ObjectPtr {
+        if (index == kNull) {
+            return nullptr;
+        }
+        if (index >= objects.size()) {
+            throw RuntimeError("Invalid heap image");
+        }
+        return objects[index];
+    };
+    switch (record.kind) {
+        case Kind::kCell:
+            As<Cell>(object)->SetFirst(at(record.refs[0]));
+            As<Cell>(object)->SetSecond(at(record.refs[1]));
+            break;
+        case Kind::kList: {
+            ListPtr list = As<List>(object);
+            for (size_t i = 0; i < record.refs.size(); ++i) {
+                list->objects_[i] = at(record.refs[i]);
+            }
+            break;
+        }
+        case Kind::kScope: {
+            ScopePtr scope = As<Scope>(object);
+            scope->parent_ = As<Scope>(at(record.refs[0]));
+            for (size_t i = 0; i < record.names.size(); ++i) {
+                scope->Set(Heap::Of(scope).InternSymbol(record.names[i]),
+                           at(record.refs[i + 1]));
+            }
+            break;
+        }
+        case Kind::kLambda: {
+            LambdaPtr lambda = As<Lambda>(object);
+            lambda->scope_ = As<Scope>(at(record.scope));
+            for (size_t i = 0; i < record.arg_count; ++i) {
+                lambda->args_[i] = at(record.refs[i]);
+            }
+            for (size_t i = record.arg_count; i < record.refs.size(); ++i) {
+                lambda->body_[i - record.arg_count] = at(record.refs[i]);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
@@ -1,23 +1,26 @@
 #include <string>
 #include <tuple>
 #include <variant>
+#include "heap.h"
 #include "object.h"
 #include "parser.h"
 #include "error.h"
 #include "tokenizer.h"
 
-ObjectPtr CastToken(Token& token, Tokenizer* tokenizer) {
+ObjectPtr CastToken(Token& token, Tokenizer* tokenizer, Heap* heap) {
     ObjectPtr res;
     if (ConstantToken* t = std::get_if<ConstantToken>(&token)) {
-        res = As<Object>(MakeNumber(t->value));
+        res = As<Object>(heap->InternNumber(t->value));
     } else if (BooleanToken* t = std::get_if<BooleanToken>(&token)) {
-        res = As<Object>(MakeBoolean(t->value));
+        res = As<Object>(MakeBoolean(*heap, t->value));
     } else if (SymbolToken* t = std::get_if<SymbolToken>(&token)) {
-        res = As<Object>(Heap::Make<Symbol>().From(t->name));
+        res = As<Object>(heap->InternSymbol(t->name));
     } else if (QuoteToken* t = std::get_if<QuoteToken>(&token)) {
-        res = As<Object>(
-            Heap::Make<Cell>().From(Heap::Make<Symbol>().From("'"),
-                                    Heap::Make<Cell>().From(Read(tokenizer), ObjectPtr(nullptr))));
+        RootScope roots(*heap);
+        ObjectPtr quoted = Read(tokenizer, heap);
+        roots.Add(quoted);
+        SymbolPtr quote = heap->InternSymbol("'");
+        res = As<Object>(heap->MakeArenaCell(quote, heap->MakeArenaCell(quoted, nullptr)));
     } else {
         throw SyntaxError("Parsing failed!");
     }
@@ -34,32 +37,35 @@ bool IsCloseBracket(Token& token) {
     return bracket_token && *bracket_token == BracketToken::CLOSE;
 }
 
-ObjectPtr Read(Tokenizer* tokenizer) {
+ObjectPtr Read(Tokenizer* tokenizer, Heap* heap) {
     if (tokenizer->IsEnd()) {
         throw SyntaxError("Parsing Failed!");
     }
+    heap->CheckNativeStack();
 
     Token token = tokenizer->GetToken();
     tokenizer->Next();
     ObjectPtr res;
     if (IsOpenBracket(token)) {
-        res = ReadList(tokenizer);
+        res = ReadList(tokenizer, heap);
     } else {
-        res = CastToken(token, tokenizer);
+        res = CastToken(token, tokenizer, heap);
     }
     return res;
 }
 
-CellPtr ReadList(Tokenizer* tokenizer) {
-    CellPtr res = Heap::Make<Cell>().From();
+CellPtr ReadList(Tokenizer* tokenizer, Heap* heap) {
     Token first = tokenizer->GetToken();
     if (IsCloseBracket(first)) {
         tokenizer->Next();
         return nullptr;
     }
-    res->SetFirst(Read(tokenizer));
+    // Interning may collect garbage, which must not take the atoms read so far.
+    RootScope roots(*heap);
+    std::vector<ObjectPtr> items;
+    roots.Add(items);
+    items.push_back(Read(tokenizer, heap));
 
-    std::vector<ObjectPtr> tail;
     size_t dot_index = std::string::npos;
     while (true) {
         if (tokenizer->IsEnd()) {
@@ -74,28 +80,23 @@ CellPtr ReadList(Tokenizer* tokenizer) {
             if (dot_index < std::string::npos) {
                 throw SyntaxError("Parsing failed!");
             } else {
-                dot_index = tail.size();
+                dot_index = items.size();
             }
         } else {
-            tail.push_back(Read(tokenizer));
+            items.push_back(Read(tokenizer, heap));
         }
     }
-    if (dot_index != std::string::npos && dot_index + 1 != tail.size()) {
+    if (dot_index != std::string::npos && dot_index + 1 != items.size()) {
         throw SyntaxError("Parsing failed!");
-    } else {
-        CellPtr cur = res;
-        for (size_t i = 0; i + 1 < tail.size(); ++i) {
-            cur->SetSecond(As<Object>(Heap::Make<Cell>().From()));
-            cur = As<Cell>(cur->GetSecond());
-            cur->SetFirst(tail[i]);
-        }
-        if (dot_index != std::string::npos) {
-            cur->SetSecond(tail.back());
-        } else if (!tail.empty()) {
-            cur->SetSecond(As<Object>(Heap::Make<Cell>().From()));
-            cur = As<Cell>(cur->GetSecond());
-            cur->SetFirst(tail.back());
-        }
     }
-    return res;
+
+    size_t count = items.size();
+    ObjectPtr res = nullptr;
+    if (dot_index != std::string::npos) {
+        res = items[--count];
+    }
+    while (count > 0) {
+        res = As<Object>(heap->MakeArenaCell(items[--count], res));
+    }
+    return As<Cell>(res);
 }
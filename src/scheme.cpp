@@ -1,83 +1,268 @@
 #include "scheme.h"
+#include "heap.h"
 #include "object.h"
+#include "vm.h"
+#include <fstream>
 #include <iostream>
 
-Interpreter::Interpreter() : scope_(Heap::Make<Scope>().From()) {
-    FunctionFactory factory = FunctionFactory::GetInstance();
+Interpreter::Interpreter()
+    : scope_(heap_.Make<Scope>().From()), mark_stack_(&heap_), marker_stack_(&heap_) {
+    FunctionFactory factory(&heap_);
     for (auto& [name, func] : factory.GetAll()) {
-        func->SetScope(scope_);
-        scope_->Set(name, func);
+        scope_->Set(heap_.InternSymbol(name), func);
     }
+    heap_.SetCollector([this](bool emergency) {
+        if (emergency) {
+            CollectAll(false);
+        } else {
+            CollectIfNeeded(false);
+        }
+    });
 }
 
 Interpreter::~Interpreter() {
-    // Heap& heap = Heap::GetInstance();
-    // for (ObjectPtr ptr : heap.GetObjects()) {
-    //     heap.Erase(ptr);
-    // }
+    if (marker_.joinable()) {
+        FinishConcurrentMark(false);
+    }
 }
 
 std::string Interpreter::Run(const std::string& s) {
+    heap_.SetStackBase(__builtin_frame_address(0));
     std::stringstream ss(s);
     Tokenizer tokenizer(&ss);
-    ObjectPtr ast = Read(&tokenizer);
-    if (!tokenizer.IsEnd()) {
-        throw SyntaxError("Parsing failed!");
-    }
-    if (!ast) {
-        throw RuntimeError("RE!");
+    std::string ans;
+    {
+        // Code retained by the evaluation is promoted into the heap, the rest of the parse tree
+        // is released once the result is serialized.
+        ArenaScope arena(heap_);
+        SafepointScope safepoints(heap_);
+        RootScope roots(heap_);
+        ObjectPtr ast = Read(&tokenizer, &heap_);
+        roots.Add(ast);
+        if (!tokenizer.IsEnd()) {
+            throw SyntaxError("Parsing failed!");
+        }
+        if (!ast) {
+            throw RuntimeError("RE!");
+        }
+        ObjectPtr res = Vm(heap_).Run(ast, scope_);
+        ans = res ? res->Serialize() : "()";
     }
-    ast->SetScope(scope_);
-    ObjectPtr res = ast->Eval(scope_);
-    std::string ans = res ? res->Serialize() : "()";
 
-    MarkAndSweep();
+    CollectIfNeeded(true);
 
     return ans;
 }
 
-void Interpreter::MarkDFS(ObjectPtr v, std::unordered_set<ObjectPtr>& marks) {
-    if (!v) {
+void Interpreter::CollectGarbage() {
+    CollectAll(true);
+}
+
+void Interpreter::SaveImage(const std::string& path) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw RuntimeError("Failed to open heap image");
+    }
+    HeapImage::Save(scope_, &out);
+}
+
+void Interpreter::LoadImage(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw RuntimeError("Failed to open heap image");
+    }
+    scope_ = HeapImage::Load(&heap_, &in);
+}
+
+HeapStatistics Interpreter::HeapStats() const {
+    HeapStatistics stats;
+    heap_.CountObjects(&stats);
+    gc_log_.Fill(&stats);
+    return stats;
+}
+
+void Interpreter::SetHeapLimit(size_t bytes) {
+    heap_.SetByteLimit(bytes);
+}
+
+void Interpreter::SetObjectLimit(size_t count) {
+    heap_.SetObjectLimit(count);
+}
+
+void Interpreter::SetStackLimit(size_t bytes) {
+    heap_.SetStackLimit(bytes);
+}
+
+void Interpreter::CollectAll(bool allow_moving) {
+    if (marker_.joinable()) {
+        FinishConcurrentMark(false);
+    }
+    MarkAndSweep(allow_moving, false);
+}
+
+void Interpreter::CollectIfNeeded(bool allow_moving) {
+    RecordSweep();
+    if (heap_.IsSweeping()) {
         return;
     }
-    marks.insert(v);
-    std::vector<ObjectPtr> to_go;
-    to_go.push_back(v->GetScope());
-    if (Is<Cell>(v)) {
-        to_go.push_back(As<Cell>(v)->GetFirst());
-        to_go.push_back(As<Cell>(v)->GetSecond());
-    } else if (Is<List>(v)) {
-        for (ObjectPtr to : As<List>(v)->Get()) {
-            to_go.push_back(to);
-        }
-    } else if (Is<Lambda>(v)) {
-        for (ObjectPtr to : As<Lambda>(v)->GetArgs()) {
-            to_go.push_back(to);
-        }
-        for (ObjectPtr to : As<Lambda>(v)->GetBody()) {
-            to_go.push_back(to);
+    if (marker_.joinable()) {
+        if (marker_done_) {
+            FinishConcurrentMark(true);
         }
-    } else if (Is<Scope>(v)) {
-        for (ObjectPtr to : As<Scope>(v)->GetAll()) {
-            to_go.push_back(to);
+    } else if (gc_policy_.ShouldCollect(heap_.GetSize())) {
+        if (concurrent_marking_) {
+            StartConcurrentMark();
+        } else {
+            MarkAndSweep(allow_moving, true);
         }
+    } else if (gc_policy_.ShouldCollectYoung(heap_.GetYoungSize())) {
+        MarkAndSweepYoung();
     }
-    for (ObjectPtr to : to_go) {
-        if (to && marks.find(to) == marks.end()) {
-            MarkDFS(to, marks);
-        }
+}
+
+void Interpreter::SetGcThreshold(size_t bytes) {
+    gc_policy_.SetThreshold(bytes);
+}
+
+void Interpreter::SetGcGrowthFactor(double factor) {
+    gc_policy_.SetGrowthFactor(factor);
+}
+
+void Interpreter::SetGcNurserySize(size_t bytes) {
+    gc_policy_.SetNurserySize(bytes);
+}
+
+void Interpreter::SetGcThreads(size_t threads) {
+    gc_threads_ = std::max<size_t>(threads, 1);
+}
+
+void Interpreter::SetCompaction(bool enabled) {
+    compaction_ = enabled;
+}
+
+void Interpreter::SetConcurrentMarking(bool enabled) {
+    concurrent_marking_ = enabled;
+}
+
+void Interpreter::MarkStack::Visit(ObjectPtr& ptr) {
+    if (!ptr) {
+        return;
+    }
+    if ((!young_only_ || !heap_->IsOld(ptr)) && heap_->Mark(ptr)) {
+        stack_.push_back(ptr);
+    }
+}
+
+void Interpreter::MarkRoots() {
+    ObjectPtr root = scope_;
+    mark_stack_.Visit(root);
+    heap_.TraceRoots(&mark_stack_);
+    Drain();
+}
+
+void Interpreter::Drain() {
+    while (!mark_stack_.IsEmpty()) {
+        mark_stack_.Pop()->Trace(&mark_stack_);
+    }
+}
+
+void Interpreter::FinishSweep() {
+    if (heap_.IsSweeping()) {
+        heap_.FinishSweep();
+        RecordSweep();
     }
 }
 
-void Interpreter::MarkAndSweep() {
-    std::unordered_set<ObjectPtr> marks;
-    MarkDFS(scope_, marks);
+void Interpreter::RecordSweep() {
+    size_t live_bytes = 0;
+    size_t reclaimed_bytes = 0;
+    if (heap_.TakeSweepResult(&live_bytes, &reclaimed_bytes)) {
+        gc_policy_.OnCollection(live_bytes);
+        gc_log_.RecordReclaimed(reclaimed_bytes);
+    }
+}
 
-    Heap& heap = Heap::GetInstance();
-    std::unordered_set<ObjectPtr> objects = heap.GetObjects();
-    for (ObjectPtr ptr : objects) {
-        if (marks.find(ptr) == marks.end()) {
-            heap.Erase(ptr);
+void Interpreter::MarkAndSweep(bool allow_moving, bool lazy) {
+    FinishSweep();
+    heap_.ReleaseIdleFrames();
+    auto start = std::chrono::steady_clock::now();
+    if (gc_threads_ > 1) {
+        ParallelMarker(&heap_, gc_threads_).Mark({scope_});
+    } else {
+        mark_stack_.SetYoungOnly(false);
+        MarkRoots();
+    }
+    if (compaction_ && allow_moving) {
+        heap_.CompactCells();
+    }
+    if (lazy) {
+        heap_.StartSweep();
+    } else {
+        heap_.Sweep();
+    }
+    gc_log_.Record(std::chrono::steady_clock::now() - start, false);
+    RecordSweep();
+}
+
+void Interpreter::MarkAndSweepYoung() {
+    FinishSweep();
+    heap_.ReleaseIdleFrames();
+    auto start = std::chrono::steady_clock::now();
+    size_t size = heap_.GetSize();
+    mark_stack_.SetYoungOnly(true);
+    for (ObjectPtr ptr : heap_.GetRemembered()) {
+        ptr->Trace(&mark_stack_);
+    }
+    MarkRoots();
+    heap_.SweepYoung();
+    gc_log_.Record(std::chrono::steady_clock::now() - start, true);
+    gc_log_.RecordReclaimed(size - heap_.GetSize());
+}
+
+void Interpreter::StartConcurrentMark() {
+    FinishSweep();
+    heap_.ReleaseIdleFrames();
+    auto start = std::chrono::steady_clock::now();
+    heap_.StartMarking();
+    marker_stack_.SetYoungOnly(false);
+    ObjectPtr root = scope_;
+    marker_stack_.Visit(root);
+    heap_.TraceRoots(&marker_stack_);
+    marker_done_ = false;
+    marker_ = std::thread(&Interpreter::ConcurrentMark, this);
+    start_pause_ = std::chrono::steady_clock::now() - start;
+}
+
+void Interpreter::ConcurrentMark() {
+    std::mutex& mutex = heap_.GetMutationMutex();
+    while (true) {
+        while (!marker_stack_.IsEmpty()) {
+            std::lock_guard lock(mutex);
+            marker_stack_.Pop()->Trace(&marker_stack_);
+        }
+        std::lock_guard lock(mutex);
+        heap_.DrainOverwritten(&marker_stack_);
+        if (marker_stack_.IsEmpty()) {
+            break;
         }
     }
+    marker_done_ = true;
+}
+
+void Interpreter::FinishConcurrentMark(bool lazy) {
+    auto start = std::chrono::steady_clock::now();
+    marker_.join();
+    heap_.TraceRoots(&marker_stack_);
+    heap_.DrainOverwritten(&marker_stack_);
+    while (!marker_stack_.IsEmpty()) {
+        marker_stack_.Pop()->Trace(&marker_stack_);
+    }
+    heap_.FinishMarking();
+    if (lazy) {
+        heap_.StartSweep();
+    } else {
+        heap_.Sweep();
+    }
+    gc_log_.Record(start_pause_ + (std::chrono::steady_clock::now() - start), false);
+    RecordSweep();
 }
@@ -0,0 +1,680 @@
+#include "vm.h"
+
+#include "error.h"
+
+#include <algorithm>
+
+namespace {
+
+// Appends the elements of a proper list to `items`, returns false for improper lists.
+bool ReadList(ObjectPtr list, std::vector<ObjectPtr>* items) {
+    while (Is<Cell>(list)) {
+        items->push_back(As<Cell>(list)->GetFirst());
+        list = As<Cell>(list)->GetSecond();
+    }
+    return !list;
+}
+
+// Whether evaluating `body` may make a lambda that captures the scope it runs in, that is
+// whether it mentions `lambda` or defines a function. Quoted data is never evaluated and
+// is skipped.
+bool MayCaptureScope(const std::vector<ObjectPtr>& body) {
+    std::vector<ObjectPtr> pending(body.begin(), body.end());
+    while (!pending.empty()) {
+        ObjectPtr object = pending.back();
+        pending.pop_back();
+        if (Is<Symbol>(object) && As<Symbol>(object)->GetName() == "lambda") {
+            return true;
+        }
+        if (!Is<Cell>(object)) {
+            continue;
+        }
+        CellPtr cell = As<Cell>(object);
+        ObjectPtr head = cell->GetFirst();
+        ObjectPtr tail = cell->GetSecond();
+        if (Is<Symbol>(head)) {
+            const std::string& name = As<Symbol>(head)->GetName();
+            if (name == "quote" || name == "'") {
+                continue;
+            }
+            if (name == "define" && Is<Cell>(tail) && Is<Cell>(As<Cell>(tail)->GetFirst())) {
+                return true;
+            }
+        }
+        pending.push_back(head);
+        pending.push_back(tail);
+    }
+    return false;
+}
+
+}  // namespace
+
+void Code::Trace(Tracer* tracer) {
+    for (ObjectPtr& constant : constants) {
+        tracer->Visit(constant);
+    }
+    for (Prototype& prototype : prototypes) {
+        prototype.code->Trace(tracer);
+    }
+}
+
+size_t Code::GetSize() const {
+    size_t size = sizeof(Code) + instructions.capacity() * sizeof(Instruction) +
+                  constants.capacity() * sizeof(ObjectPtr) +
+                  sites.capacity() * sizeof(CallSite) + prototypes.capacity() * sizeof(Prototype) +
+                  addresses.capacity() * sizeof(Address);
+    for (const Prototype& prototype : prototypes) {
+        size += prototype.code->GetSize();
+    }
+    return size;
+}
+
+std::shared_ptr<Code> Compiler::Compile(const std::vector<ObjectPtr>& body) {
+    code_ = std::make_shared<Code>();
+    code_->may_capture_scope = MayCaptureScope(body);
+    for (size_t i = 0; i < body.size(); ++i) {
+        if (i > 0) {
+            Emit(Op::kPop);
+        }
+        CompileExpression(body[i]);
+    }
+    if (body.empty()) {
+        Emit(Op::kConstant, AddConstant(nullptr));
+    }
+    Emit(Op::kReturn);
+    // Calls followed by nothing but jumps to a return are tail calls.
+    for (Instruction& instruction : code_->instructions) {
+        if (instruction.op != Op::kApply) {
+            continue;
+        }
+        const Instruction* next = &instruction + 1;
+        while (next->op == Op::kJump) {
+            next = &code_->instructions[next->arg];
+        }
+        if (next->op == Op::kReturn) {
+            instruction.op = Op::kTailApply;
+        }
+    }
+    return std::move(code_);
+}
+
+void Compiler::CompileExpression(ObjectPtr expression) {
+    if (!expression || Is<Number>(expression) || Is<Boolean>(expression)) {
+        Emit(Op::kConstant, AddConstant(expression));
+    } else if (Is<Symbol>(expression)) {
+        EmitVariable(expression, Op::kLoadLocal, Op::kLoadOuter, Op::kLoad);
+    } else if (Is<Cell>(expression) && As<Cell>(expression)->GetFirst()) {
+        CompileCall(As<Cell>(expression));
+    } else {
+        Emit(Op::kEval, AddConstant(expression));
+    }
+}
+
+void Compiler::CompileCall(CellPtr form) {
+    Heap::Of(form).CheckNativeStack();
+    std::vector<ObjectPtr> args;
+    if (!ReadList(form->GetSecond(), &args)) {
+        // Improper forms are left to the tree-walking evaluator.
+        Emit(Op::kEval, AddConstant(form));
+        return;
+    }
+
+    ObjectPtr head = form->GetFirst();
+    FunctionPtr builtin = nullptr;
+    if (Is<Symbol>(head) && scope_) {
+        ObjectPtr value = scope_->Get(As<Symbol>(head));
+        if (Is<Function>(value) && !Is<Lambda>(value)) {
+            builtin = As<Function>(value);
+        }
+    }
+    uint32_t site = AddSite(builtin, args);
+    CompileExpression(head);
+    if (builtin) {
+        uint32_t check = Emit(Op::kInline, site);
+        if (CompileInline(builtin, site, args, Heap::Of(form).IsArena(form))) {
+            code_->sites[site].end = Here();
+            return;
+        }
+        code_->instructions[check].op = Op::kCall;
+    } else {
+        Emit(Op::kCall, site);
+    }
+    for (ObjectPtr arg : args) {
+        CompileExpression(arg);
+    }
+    Emit(Op::kApply, args.size());
+    code_->sites[site].end = Here();
+}
+
+bool Compiler::CompileInline(FunctionPtr builtin, uint32_t site,
+                             const std::vector<ObjectPtr>& args, bool in_arena) {
+    // Builtins evaluate their arguments themselves and would crash on a missing one, those
+    // calls keep going through Function::Apply.
+    size_t count = args.size();
+    bool complete = std::find(args.begin(), args.end(), nullptr) == args.end();
+    if (dynamic_cast<If*>(builtin)) {
+        if ((count != 2 && count != 3) || !args[0]) {
+            return false;
+        }
+        CompileExpression(args[0]);
+        uint32_t to_else = Emit(Op::kJumpIfFalse);
+        CompileExpression(args[1]);
+        uint32_t to_end = Emit(Op::kJump);
+        code_->instructions[to_else].arg = Here();
+        CompileExpression(count == 3 ? args[2] : nullptr);
+        code_->instructions[to_end].arg = Here();
+        return true;
+    }
+    if (dynamic_cast<QuoteFunction*>(builtin)) {
+        // Data read into the arena is left to the builtin, which promotes it.
+        if (count != 1 || (in_arena && Is<Cell>(args[0]))) {
+            return false;
+        }
+        Emit(Op::kConstant, AddConstant(args[0]));
+        return true;
+    }
+    if (dynamic_cast<LambdaFunction*>(builtin)) {
+        std::vector<ObjectPtr> params;
+        if (in_arena || count < 2 || !ReadList(args[0], &params)) {
+            return false;
+        }
+        Emit(Op::kClosure, AddPrototype(params, {args.begin() + 1, args.end()}));
+        return true;
+    }
+    if (dynamic_cast<Define*>(builtin) && Is<Cell>(args.empty() ? nullptr : args[0])) {
+        std::vector<ObjectPtr> signature;
+        if (in_arena || count < 2 || !ReadList(args[0], &signature) ||
+            !Is<Symbol>(signature[0])) {
+            return false;
+        }
+        std::vector<ObjectPtr> params(signature.begin() + 1, signature.end());
+        Emit(Op::kClosure, AddPrototype(params, {args.begin() + 1, args.end()}));
+        Emit(Op::kDefine, AddConstant(signature[0]));
+        return true;
+    }
+    if (dynamic_cast<Define*>(builtin) || dynamic_cast<Set*>(builtin)) {
+        if (count != 2 || !Is<Symbol>(args[0]) || !args[1]) {
+            return false;
+        }
+        CompileExpression(args[1]);
+        if (dynamic_cast<Define*>(builtin)) {
+            Emit(Op::kDefine, AddConstant(args[0]));
+        } else {
+            EmitVariable(args[0], Op::kSetLocal, Op::kSetOuter, Op::kSet);
+        }
+        return true;
+    }
+    if (!complete) {
+        return false;
+    }
+    if (dynamic_cast<CollapseFunction*>(builtin)) {
+        if (count == 0) {
+            return false;
+        }
+        CompileExpression(args[0]);
+        if (count == 1) {
+            Emit(Op::kCollapse1, site);
+        }
+        for (size_t i = 1; i < count; ++i) {
+            CompileExpression(args[i]);
+            Emit(Op::kCollapse2, site);
+        }
+        return true;
+    }
+    if (dynamic_cast<UnaryFunction*>(builtin)) {
+        if (count != 1) {
+            return false;
+        }
+        CompileExpression(args[0]);
+        Emit(Op::kUnary, site);
+        return true;
+    }
+
+    Op op;
+    size_t arity = 2;
+    if (dynamic_cast<Equal*>(builtin)) {
+        op = Op::kEqual;
+    } else if (dynamic_cast<Less*>(builtin)) {
+        op = Op::kLess;
+    } else if (dynamic_cast<Greater*>(builtin)) {
+        op = Op::kGreater;
+    } else if (dynamic_cast<NotLess*>(builtin)) {
+        op = Op::kNotLess;
+    } else if (dynamic_cast<NotGreater*>(builtin)) {
+        op = Op::kNotGreater;
+    } else if (dynamic_cast<Cons*>(builtin)) {
+        op = Op::kCons;
+    } else if (dynamic_cast<Car*>(builtin)) {
+        op = Op::kCar;
+        arity = 1;
+    } else if (dynamic_cast<Cdr*>(builtin)) {
+        op = Op::kCdr;
+        arity = 1;
+    } else {
+        return false;
+    }
+    if (count != arity) {
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        CompileExpression(args[i]);
+        // Comparisons check their first operand before evaluating the second one.
+        if (i == 0 && op != Op::kCons && arity == 2) {
+            Emit(Op::kCheckNumber);
+        }
+    }
+    Emit(op);
+    return true;
+}
+
+uint32_t Compiler::AddConstant(ObjectPtr object) {
+    code_->constants.push_back(object);
+    return code_->constants.size() - 1;
+}
+
+uint32_t Compiler::AddSite(FunctionPtr builtin, const std::vector<ObjectPtr>& args) {
+    CallSite site;
+    site.builtin = AddConstant(builtin);
+    site.first_arg = code_->constants.size();
+    site.arg_count = args.size();
+    for (ObjectPtr arg : args) {
+        AddConstant(arg);
+    }
+    code_->sites.push_back(site);
+    return code_->sites.size() - 1;
+}
+
+uint32_t Compiler::AddPrototype(const std::vector<ObjectPtr>& params,
+                               const std::vector<ObjectPtr>& body) {
+    Prototype prototype;
+    prototype.first_param = code_->constants.size();
+    prototype.param_count = params.size();
+    for (ObjectPtr param : params) {
+        AddConstant(param);
+    }
+    prototype.first_body = code_->constants.size();
+    prototype.body_count = body.size();
+    for (ObjectPtr expression : body) {
+        AddConstant(expression);
+    }
+    std::vector<const std::vector<ObjectPtr>*> nested = {&params};
+    nested.insert(nested.end(), params_.begin(), params_.end());
+    prototype.code = Compiler(scope_, std::move(nested)).Compile(body);
+    code_->prototypes.push_back(std::move(prototype));
+    return code_->prototypes.size() - 1;
+}
+
+uint32_t Compiler::Emit(Op op, uint32_t arg) {
+    code_->instructions.push_back({op, arg});
+    return code_->instructions.size() - 1;
+}
+
+uint32_t Compiler::Here() const {
+    return code_->instructions.size();
+}
+
+bool Compiler::Resolve(ObjectPtr symbol, Address* address) const {
+    for (size_t depth = 0; depth < params_.size(); ++depth) {
+        const std::vector<ObjectPtr>& params = *params_[depth];
+        // The last of repeated parameters is the one bound.
+        for (size_t slot = params.size(); slot > 0; --slot) {
+            if (params[slot - 1] == symbol) {
+                address->depth = depth;
+                address->slot = slot - 1;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void Compiler::EmitVariable(ObjectPtr symbol, Op local, Op outer, Op global) {
+    Address address;
+    if (!Resolve(symbol, &address)) {
+        Emit(global, AddConstant(symbol));
+    } else if (address.depth == 0) {
+        Emit(local, address.slot);
+    } else {
+        address.name = AddConstant(symbol);
+        code_->addresses.push_back(address);
+        Emit(outer, code_->addresses.size() - 1);
+    }
+}
+
+Vm::Vm(Heap& heap) : heap_(heap), roots_(heap) {
+    // Machines nest when builtins call lambdas.
+    heap_.CheckNativeStack();
+    roots_.Add(stack_);
+}
+
+Vm::~Vm() {
+    // Frames are left on the way out of an exception.
+    while (!frames_.empty()) {
+        PopFrame();
+    }
+}
+
+ObjectPtr Vm::Run(ObjectPtr expression, ScopePtr scope) {
+    std::shared_ptr<Code> code = Compiler(scope).Compile({expression});
+    RootScope roots(heap_);
+    roots.Add(code->constants);
+    stack_.push_back(nullptr);
+    stack_.push_back(scope);
+    heap_.ReserveStack(kFrameBytes);
+    frames_.push_back({code.get(), 0, 0, false});
+    return Execute();
+}
+
+ObjectPtr Vm::Call(LambdaPtr lambda, const std::vector<ObjectPtr>& args) {
+    stack_.push_back(lambda);
+    stack_.insert(stack_.end(), args.begin(), args.end());
+    Enter(args.size());
+    return Execute();
+}
+
+void Vm::Compile(LambdaPtr lambda) {
+    if (lambda->code_) {
+        return;
+    }
+    std::shared_ptr<Code> code = Compiler(lambda->scope_, {&lambda->args_}).Compile(lambda->body_);
+    Heap& heap = Heap::Of(lambda);
+    {
+        // Takes the mutation lock, as a concurrent marker may be tracing the lambda.
+        WriteBarrier barrier(lambda, nullptr, nullptr);
+        lambda->code_ = std::move(code);
+        lambda->code_size_ = lambda->code_->GetSize();
+    }
+    for (ObjectPtr constant : lambda->code_->constants) {
+        heap.Remember(lambda, constant);
+    }
+    heap.AddExternalSize(lambda, lambda->code_size_);
+}
+
+void Vm::Enter(size_t argc) {
+    size_t base = stack_.size() - argc - 1;
+    LambdaPtr lambda = As<Lambda>(stack_[base]);
+    if (argc != lambda->args_.size()) {
+        throw RuntimeError("RE!");
+    }
+    Compile(lambda);
+    heap_.ReserveStack(kFrameBytes);
+    frames_.push_back({lambda->code_.get(), 0, base, false});
+    bool pooled = !lambda->code_->may_capture_scope;
+    ScopePtr scope = pooled ? heap_.PushFrame(lambda->scope_)
+                            : heap_.Make<Scope>().From(lambda->scope_);
+    frames_.back().pooled = pooled;
+    for (ObjectPtr param : lambda->args_) {
+        if (!Is<Symbol>(param)) {
+            throw RuntimeError("RE!");
+        }
+    }
+    scope->Bind(lambda, &stack_[base + 1]);
+    stack_.resize(base + 1);
+    stack_.push_back(scope);
+}
+
+void Vm::Leave() {
+    stack_.resize(frames_.back().base);
+    PopFrame();
+}
+
+void Vm::LeaveForTailCall(size_t argc) {
+    const Frame& frame = frames_.back();
+    // The scope of the frame is overwritten and dropped, whatever it still refers to is
+    // reachable from elsewhere.
+    std::move(stack_.end() - argc - 1, stack_.end(), stack_.begin() + frame.base);
+    stack_.resize(frame.base + argc + 1);
+    PopFrame();
+}
+
+void Vm::PopFrame() {
+    if (frames_.back().pooled) {
+        heap_.PopFrame();
+    }
+    frames_.pop_back();
+    heap_.ReleaseStack(kFrameBytes);
+}
+
+ObjectPtr Vm::Apply(ObjectPtr function, const Code& code, const CallSite& site,
+                    ScopePtr scope) {
+    FunctionPtr func = As<Function>(function);
+    if (!func) {
+        throw RuntimeError("RE!");
+    }
+    auto first = code.constants.begin() + site.first_arg;
+    std::vector<ObjectPtr> args(first, first + site.arg_count);
+    if (!Is<Lambda>(func)) {
+        return func->Apply(args, scope);
+    }
+    RootScope roots(heap_);
+    roots.Add(func);
+    roots.Add(args);
+    for (ObjectPtr& arg : args) {
+        if (arg) {
+            arg = arg->Eval(scope);
+        }
+    }
+    return func->Apply(args, scope);
+}
+
+ScopePtr Vm::FindFrame(ScopePtr scope, const Address& address) {
+    for (uint32_t depth = 0; depth < address.depth; ++depth) {
+        if (!scope || scope->IsExtended()) {
+            return nullptr;
+        }
+        scope = scope->GetParentScope();
+    }
+    // Scopes read from a heap image keep parameters by name.
+    return scope && address.slot < scope->GetSlotCount() ? scope : nullptr;
+}
+
+ObjectPtr Vm::Execute() {
+    Frame* frame = &frames_.back();
+    ScopePtr scope = As<Scope>(stack_[frame->base + 1]);
+    while (true) {
+        const Code& code = *frame->code;
+        Instruction instruction = code.instructions[frame->pc++];
+        switch (instruction.op) {
+            case Op::kConstant:
+                stack_.push_back(code.constants[instruction.arg]);
+                break;
+            case Op::kLoad: {
+                ObjectPtr value = scope->Get(As<Symbol>(code.constants[instruction.arg]));
+                if (!value) {
+                    throw NameError("Symbol not found!");
+                }
+                stack_.push_back(value);
+                break;
+            }
+            case Op::kLoadLocal: {
+                ObjectPtr value = scope->GetSlot(instruction.arg);
+                if (!value) {
+                    throw NameError("Symbol not found!");
+                }
+                stack_.push_back(value);
+                break;
+            }
+            case Op::kLoadOuter: {
+                const Address& address = code.addresses[instruction.arg];
+                ScopePtr frame_scope = FindFrame(scope, address);
+                ObjectPtr value =
+                    frame_scope ? frame_scope->GetSlot(address.slot)
+                                : scope->Get(As<Symbol>(code.constants[address.name]));
+                if (!value) {
+                    throw NameError("Symbol not found!");
+                }
+                stack_.push_back(value);
+                break;
+            }
+            case Op::kEval:
+                stack_.push_back(code.constants[instruction.arg]->Eval(scope));
+                break;
+            case Op::kPop:
+                stack_.pop_back();
+                break;
+            case Op::kJump:
+                frame->pc = instruction.arg;
+                break;
+            case Op::kJumpIfFalse: {
+                ObjectPtr cond = Pop();
+                if (Is<Boolean>(cond) && !As<Boolean>(cond)->GetValue()) {
+                    frame->pc = instruction.arg;
+                }
+                break;
+            }
+            case Op::kCall: {
+                const CallSite& site = code.sites[instruction.arg];
+                ObjectPtr head = stack_.back();
+                if (Is<Lambda>(head)) {
+                    break;
+                }
+                stack_.back() = Apply(head, code, site, scope);
+                frame->pc = site.end;
+                break;
+            }
+            case Op::kInline: {
+                const CallSite& site = code.sites[instruction.arg];
+                ObjectPtr head = stack_.back();
+                if (head == code.constants[site.builtin]) {
+                    stack_.pop_back();
+                    break;
+                }
+                stack_.back() = Apply(head, code, site, scope);
+                frame->pc = site.end;
+                break;
+            }
+            case Op::kTailApply:
+                LeaveForTailCall(instruction.arg);
+                [[fallthrough]];
+            case Op::kApply:
+                Enter(instruction.arg);
+                frame = &frames_.back();
+                scope = As<Scope>(stack_[frame->base + 1]);
+                break;
+            case Op::kReturn: {
+                ObjectPtr result = Pop();
+                Leave();
+                if (frames_.empty()) {
+                    return result;
+                }
+                stack_.push_back(result);
+                frame = &frames_.back();
+                scope = As<Scope>(stack_[frame->base + 1]);
+                break;
+            }
+            case Op::kClosure: {
+                const Prototype& prototype = code.prototypes[instruction.arg];
+                auto constants = code.constants.begin();
+                std::vector<ObjectPtr> params(constants + prototype.first_param,
+                                              constants + prototype.first_param +
+                                                  prototype.param_count);
+                std::vector<ObjectPtr> body(constants + prototype.first_body,
+                                            constants + prototype.first_body +
+                                                prototype.body_count);
+                LambdaPtr lambda = heap_.Make<Lambda>().From(params, body);
+                lambda->SetScope(scope);
+                lambda->code_ = prototype.code;
+                stack_.push_back(lambda);
+                break;
+            }
+            case Op::kDefine: {
+                ObjectPtr value = Pop();
+                scope->Set(As<Symbol>(code.constants[instruction.arg]), value);
+                stack_.push_back(nullptr);
+                break;
+            }
+            case Op::kSet: {
+                ObjectPtr value = Pop();
+                SymbolPtr name = As<Symbol>(code.constants[instruction.arg]);
+                if (!scope->Get(name)) {
+                    throw NameError("Set: No such variable!");
+                }
+                scope->SetRec(name, value);
+                stack_.push_back(nullptr);
+                break;
+            }
+            case Op::kSetLocal: {
+                ObjectPtr value = Pop();
+                if (!scope->GetSlot(instruction.arg)) {
+                    throw NameError("Set: No such variable!");
+                }
+                scope->SetSlot(instruction.arg, value);
+                stack_.push_back(nullptr);
+                break;
+            }
+            case Op::kSetOuter: {
+                ObjectPtr value = Pop();
+                const Address& address = code.addresses[instruction.arg];
+                ScopePtr frame_scope = FindFrame(scope, address);
+                if (frame_scope) {
+                    if (!frame_scope->GetSlot(address.slot)) {
+                        throw NameError("Set: No such variable!");
+                    }
+                    frame_scope->SetSlot(address.slot, value);
+                } else {
+                    SymbolPtr name = As<Symbol>(code.constants[address.name]);
+                    if (!scope->Get(name)) {
+                        throw NameError("Set: No such variable!");
+                    }
+                    scope->SetRec(name, value);
+                }
+                stack_.push_back(nullptr);
+                break;
+            }
+            case Op::kCheckNumber:
+                As<Number>(stack_.back());
+                break;
+            case Op::kCollapse1: {
+                auto builtin = static_cast<CollapseFunction*>(
+                    code.constants[code.sites[instruction.arg].builtin]);
+                stack_.back() = builtin->ApplyBinary(scope, stack_.back());
+                break;
+            }
+            case Op::kCollapse2: {
+                auto builtin = static_cast<CollapseFunction*>(
+                    code.constants[code.sites[instruction.arg].builtin]);
+                ObjectPtr b = Pop();
+                stack_.back() = builtin->ApplyBinary(scope, stack_.back(), b);
+                break;
+            }
+            case Op::kUnary: {
+                auto builtin = static_cast<UnaryFunction*>(
+                    code.constants[code.sites[instruction.arg].builtin]);
+                stack_.back() = builtin->ApplyUnary(stack_.back());
+                break;
+            }
+            case Op::kEqual:
+            case Op::kLess:
+            case Op::kGreater:
+            case Op::kNotLess:
+            case Op::kNotGreater: {
+                int64_t b = As<Number>(Pop())->GetValue();
+                int64_t a = As<Number>(stack_.back())->GetValue();
+                bool res = instruction.op == Op::kEqual     ? a == b
+                           : instruction.op == Op::kLess    ? a < b
+                           : instruction.op == Op::kGreater ? a > b
+                           : instruction.op == Op::kNotLess ? a >= b
+                                                            : a <= b;
+                stack_.back() = MakeBoolean(heap_, res);
+                break;
+            }
+            case Op::kCar:
+            case Op::kCdr: {
+                CellPtr cell = As<Cell>(stack_.back());
+                if (!cell) {
+                    throw RuntimeError("RE!");
+                }
+                stack_.back() = instruction.op == Op::kCar ? cell->GetFirst() : cell->GetSecond();
+                break;
+            }
+            case Op::kCons: {
+                // Both parts stay on the stack until the cell holds them.
+                size_t size = stack_.size();
+                CellPtr cell = heap_.Make<Cell>().From(stack_[size - 2], stack_[size - 1]);
+                stack_.pop_back();
+                stack_.back() = cell;
+                break;
+            }
+        }
+    }
+}
@@ -10,25 +10,32 @@ class SchemeTest {
 public:
     void ExpectEq(std::string expression, const std::string& result) {
         REQUIRE(interpreter_.Run(expression) == result);
+        interpreter_.CollectGarbage();
     }
 
     void ExpectNoError(std::string expression) {
         REQUIRE_NOTHROW(interpreter_.Run(expression));
+        interpreter_.CollectGarbage();
     }
 
     void ExpectSyntaxError(std::string expression) {
         REQUIRE_THROWS_AS(interpreter_.Run(expression), SyntaxError);
+        interpreter_.CollectGarbage();
     }
 
     void ExpectRuntimeError(std::string expression) {
         REQUIRE_THROWS_AS(interpreter_.Run(expression), RuntimeError);
+        interpreter_.CollectGarbage();
     }
 
     void ExpectNameError(std::string expression) {
         REQUIRE_THROWS_AS(interpreter_.Run(expression), NameError);
+        interpreter_.CollectGarbage();
     }
 
 private:
+    // Garbage is collected after every expression rather than by the GC policy,
+    // so that allocation checks observe all garbage freed.
     Interpreter interpreter_;
 };
 
@@ -12,6 +12,7 @@ static constexpr uint32_t kShotsCount = 100000;
 
 TEST_CASE("Fuzzing-1") {
     Fuzzer fuzzer;
+    Heap heap;
 
     for (uint32_t i = 0; i < kShotsCount; ++i) {
         try {
@@ -22,7 +23,7 @@ TEST_CASE("Fuzzing-1") {
             std::stringstream ss{req};
             Tokenizer tokenizer{&ss};
             while (!tokenizer.IsEnd()) {
-                Read(&tokenizer);
+                Read(&tokenizer, &heap);
             }
         } catch (const SyntaxError&) {
         }
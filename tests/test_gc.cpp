@@ -0,0 +1,513 @@
+#include "scheme_test.h"
+
+#include <string>
+#include <thread>
+
+TEST_CASE_METHOD(SchemeTest, "LongListSurvivesCollection") {
+    std::string list = "(define x '(";
+    for (uint32_t i = 0; i < 1'000'000; ++i) {
+        list += "1 ";
+    }
+    list += "2))";
+    ExpectNoError(list);
+    ExpectEq("(car x)", "1");
+    ExpectEq("(list-ref x 1000000)", "2");
+}
+
+TEST_CASE_METHOD(SchemeTest, "CapturedParentScopeSurvivesCollection") {
+    ExpectNoError("(define (foo x) (lambda () (lambda () x)))");
+    ExpectNoError("(define bar ((foo 1543)))");
+    ExpectNoError("(define foo 0)");
+    ExpectEq("(bar)", "1543");
+}
+
+TEST_CASE("CollectionFollowsGcPolicy") {
+    Interpreter interpreter;
+    interpreter.SetGcThreshold(1 << 30);
+    interpreter.Run("(define x '(1 2 3))");
+    interpreter.CollectGarbage();
+
+    alloc_checker::ResetCounters();
+    REQUIRE(interpreter.Run("(list-tail x 1)") == "(2 3)");
+    REQUIRE(alloc_checker::AllocCount() > alloc_checker::DeallocCount());
+
+    interpreter.CollectGarbage();
+    REQUIRE(alloc_checker::AllocCount() == alloc_checker::DeallocCount());
+
+    interpreter.SetGcThreshold(0);
+    size_t collections = interpreter.HeapStats().collections;
+    REQUIRE(interpreter.Run("(list-tail x 1)") == "(2 3)");
+    REQUIRE(interpreter.HeapStats().collections == collections + 1);
+}
+
+TEST_CASE("MinorCollectionKeepsObjectsStoredIntoOldOnes") {
+    Interpreter interpreter;
+    interpreter.SetGcThreshold(1 << 30);
+    interpreter.SetGcNurserySize(0);
+
+    interpreter.Run("(define x (cons 1 2))");
+    interpreter.Run("(set-car! x (cons 3 4))");
+    interpreter.Run("(define y (cons 5 6))");
+    interpreter.Run("(list-tail '(7 8 9) 1)");
+    REQUIRE(interpreter.Run("x") == "((3 . 4) . 2)");
+    REQUIRE(interpreter.Run("y") == "(5 . 6)");
+
+    interpreter.CollectGarbage();
+    alloc_checker::ResetCounters();
+    REQUIRE(interpreter.Run("(list-tail x 1)") == "(2)");
+    REQUIRE(alloc_checker::AllocCount() == alloc_checker::DeallocCount());
+}
+
+TEST_CASE("ConcurrentMarkingKeepsReachableObjects") {
+    Interpreter interpreter;
+    interpreter.SetConcurrentMarking(true);
+    interpreter.SetGcThreshold(0);
+
+    interpreter.Run("(define x (cons 0 0))");
+    interpreter.Run("(define (wrap x) (lambda () x))");
+    for (int i = 0; i < 1000; ++i) {
+        std::string n = std::to_string(i);
+        interpreter.Run("(define y" + n + " (wrap (cons " + n + " '(1 2 3))))");
+        interpreter.Run("(set-car! x (cons " + n + " (car x)))");
+        interpreter.Run("(set-cdr! x (list-tail '(4 5 6) 1))");
+    }
+    for (int i = 0; i < 1000; i += 111) {
+        std::string n = std::to_string(i);
+        REQUIRE(interpreter.Run("(y" + n + ")") == "(" + n + " 1 2 3)");
+    }
+    REQUIRE(interpreter.Run("(car (car x))") == "999");
+    REQUIRE(interpreter.Run("(cdr x)") == "(5 6)");
+
+    interpreter.CollectGarbage();
+    REQUIRE(interpreter.Run("(y998)") == "(998 1 2 3)");
+    REQUIRE(interpreter.Run("(car (cdr (car x)))") == "998");
+}
+
+TEST_CASE("ParallelMarkingKeepsReachableObjects") {
+    Interpreter interpreter;
+    interpreter.SetGcThreads(4);
+
+    std::string list = "(define x '(";
+    for (uint32_t i = 0; i < 10'000; ++i) {
+        list += "(" + std::to_string(i) + " . " + std::to_string(i) + ") ";
+    }
+    list += "))";
+    interpreter.Run(list);
+    interpreter.Run("(define (wrap x) (lambda () x))");
+    for (int i = 0; i < 100; ++i) {
+        std::string n = std::to_string(i);
+        interpreter.Run("(define y" + n + " (wrap (cons " + n + " (list-tail x " + n + "))))");
+    }
+    interpreter.CollectGarbage();
+
+    REQUIRE(interpreter.Run("(list-ref x 9999)") == "(9999 . 9999)");
+    for (int i = 0; i < 100; i += 11) {
+        std::string n = std::to_string(i);
+        REQUIRE(interpreter.Run("(car (y" + n + "))") == n);
+        REQUIRE(interpreter.Run("(car (cdr (y" + n + ")))") == "(" + n + " . " + n + ")");
+    }
+}
+
+TEST_CASE("CompactionKeepsListStructure") {
+    Interpreter interpreter;
+    interpreter.SetCompaction(true);
+
+    interpreter.Run("(define x '(1 2 3 4 5))");
+    interpreter.Run("(define y (cons 0 (cdr (cdr x))))");
+    interpreter.Run("(define z '(1 . 2))");
+    interpreter.Run("(set-cdr! z z)");
+    interpreter.Run("(define (wrap x) (lambda () (car x)))");
+    interpreter.Run("(define w (wrap '((6 7) 8)))");
+    interpreter.CollectGarbage();
+
+    REQUIRE(interpreter.Run("x") == "(1 2 3 4 5)");
+    REQUIRE(interpreter.Run("y") == "(0 3 4 5)");
+    interpreter.Run("(set-car! (cdr y) 9)");
+    REQUIRE(interpreter.Run("x") == "(1 2 9 4 5)");
+    REQUIRE(interpreter.Run("(car (cdr (cdr (cdr z))))") == "1");
+    REQUIRE(interpreter.Run("(w)") == "(6 7)");
+
+    interpreter.CollectGarbage();
+    REQUIRE(interpreter.Run("x") == "(1 2 9 4 5)");
+    REQUIRE(interpreter.Run("(w)") == "(6 7)");
+}
+
+TEST_CASE("SmallNumbersAndBooleansAreShared") {
+    Heap heap;
+    REQUIRE(heap.GetNumber(-5) == heap.GetNumber(-5));
+    REQUIRE(heap.GetNumber(1000)->GetValue() == 1000);
+    REQUIRE(heap.GetNumber(100000) != heap.GetNumber(100000));
+    REQUIRE(heap.GetBoolean(true) == heap.GetBoolean(true));
+    REQUIRE(heap.GetBoolean(false)->GetValue() == false);
+
+    Interpreter interpreter;
+    interpreter.Run("(define x 5)");
+    interpreter.Run("(define y (= x 5))");
+    interpreter.CollectGarbage();
+    interpreter.CollectGarbage();
+    REQUIRE(interpreter.Run("(+ x 1)") == "6");
+    REQUIRE(interpreter.Run("y") == "#t");
+}
+
+TEST_CASE("ObjectsCarryTypeTags") {
+    STATIC_REQUIRE(sizeof(Number) <= 32);
+    STATIC_REQUIRE(sizeof(Cell) <= 40);
+
+    Heap heap;
+    ObjectPtr number = heap.GetNumber(100000);
+    ObjectPtr symbol = heap.InternSymbol("x");
+    ObjectPtr cell = heap.Make<Cell>().From(number, symbol);
+    ObjectPtr lambda = heap.Make<Lambda>().From(std::vector<ObjectPtr>(), std::vector<ObjectPtr>());
+    ObjectPtr builtin = heap.Make<Plus>().From();
+    REQUIRE(Is<Number>(number));
+    REQUIRE(Is<Symbol>(symbol));
+    REQUIRE(Is<Cell>(cell));
+    REQUIRE(!Is<Cell>(number));
+    REQUIRE(Is<Function>(lambda));
+    REQUIRE(Is<Function>(builtin));
+    REQUIRE(Is<Lambda>(lambda));
+    REQUIRE(!Is<Lambda>(builtin));
+    REQUIRE(!Is<Function>(cell));
+    REQUIRE(Is<Object>(builtin));
+    REQUIRE(!Is<Number>(nullptr));
+    REQUIRE(As<Cell>(cell)->GetSecond() == symbol);
+    REQUIRE(As<Cell>(nullptr) == nullptr);
+    REQUIRE_THROWS_AS(As<Number>(nullptr), RuntimeError);
+    REQUIRE_THROWS_AS(As<Scope>(lambda), RuntimeError);
+}
+
+TEST_CASE("InterpretersHaveSeparateHeaps") {
+    Interpreter first;
+    Interpreter second;
+    first.Run("(define x '(1 2 3))");
+    second.Run("(define x 100000)");
+
+    std::thread worker([&second] {
+        for (int i = 0; i < 100; ++i) {
+            second.Run("(define y (cons x x))");
+            second.CollectGarbage();
+        }
+    });
+    for (int i = 0; i < 100; ++i) {
+        first.Run("(define y (cons x x))");
+        first.CollectGarbage();
+    }
+    worker.join();
+
+    REQUIRE(first.Run("x") == "(1 2 3)");
+    REQUIRE(second.Run("y") == "(100000 . 100000)");
+}
+
+TEST_CASE("CollectionsRunDuringEvaluation") {
+    Interpreter interpreter;
+    SECTION("Full") {
+        interpreter.SetGcThreshold(0);
+    }
+    SECTION("Parallel") {
+        interpreter.SetGcThreshold(0);
+        interpreter.SetGcThreads(4);
+    }
+    SECTION("Concurrent") {
+        interpreter.SetGcThreshold(0);
+        interpreter.SetConcurrentMarking(true);
+    }
+    SECTION("Young") {
+        interpreter.SetGcNurserySize(0);
+    }
+
+    interpreter.Run("(define (build n) (if (= n 0) '() (cons (* n 10000) (build (- n 1)))))");
+    interpreter.Run("(define (sum l n) (if (= n 0) 0 (+ (car l) (sum (cdr l) (- n 1)))))");
+    interpreter.Run("(define (pair n) (cons (list-ref (build n) 0) (list-tail (build n) 1)))");
+    REQUIRE(interpreter.Run("(sum (build 2000) 2000)") == "20010000000");
+    REQUIRE(interpreter.Run("(car (pair 1000))") == "10000000");
+    REQUIRE(interpreter.Run("(sum (cdr (pair 1000)) 999)") == "4995000000");
+}
+
+TEST_CASE("HeapLimitRaisesOutOfMemory") {
+    Interpreter interpreter;
+    interpreter.SetGcThreshold(1 << 30);
+    interpreter.SetGcNurserySize(1 << 30);
+    interpreter.Run("(define (build n) (if (= n 0) '() (cons (* n 10000) (build (- n 1)))))");
+    interpreter.Run("(define (sum l n) (if (= n 0) 0 (+ (car l) (sum (cdr l) (- n 1)))))");
+    interpreter.Run("(define x (build 10))");
+    interpreter.SetHeapLimit(1 << 20);
+
+    for (int i = 0; i < 200; ++i) {
+        REQUIRE(interpreter.Run("(sum (build 100) 100)") == "50500000");
+    }
+    REQUIRE_THROWS_AS(interpreter.Run("(build 100000)"), OutOfMemory);
+    REQUIRE_THROWS_AS(interpreter.Run("(build 100000)"), RuntimeError);
+    REQUIRE(interpreter.Run("(sum x 10)") == "550000");
+
+    interpreter.SetHeapLimit(0);
+    interpreter.SetObjectLimit(5000);
+    REQUIRE(interpreter.Run("(sum (build 100) 100)") == "50500000");
+    REQUIRE_THROWS_AS(interpreter.Run("(build 10000)"), OutOfMemory);
+    REQUIRE(interpreter.Run("(sum x 10)") == "550000");
+}
+
+TEST_CASE("StackLimitStopsDeepRecursion") {
+    Interpreter interpreter;
+    interpreter.Run("(define (depth n) (if (= n 0) 0 (+ 1 (depth (- n 1)))))");
+    interpreter.Run("(define (nested n) (if (= n 0) 0 (max 1 (nested (- n 1)))))");
+    REQUIRE(interpreter.Run("(depth 100000)") == "100000");
+    REQUIRE_THROWS_AS(interpreter.Run("(depth 10000000)"), RuntimeError);
+    REQUIRE_THROWS_AS(interpreter.Run("(nested 1000000)"), RuntimeError);
+    REQUIRE_THROWS_AS(interpreter.Run(std::string(1000000, '(')), RuntimeError);
+
+    interpreter.SetStackLimit(1 << 20);
+    REQUIRE(interpreter.Run("(depth 1000)") == "1000");
+    REQUIRE_THROWS_AS(interpreter.Run("(depth 100000)"), RuntimeError);
+    interpreter.SetStackLimit(0);
+    REQUIRE(interpreter.Run("(depth 100000)") == "100000");
+}
+
+TEST_CASE("HeapStatsReportsObjectsAndCollections") {
+    Interpreter interpreter;
+    interpreter.Run("(define x '(100000 200000 300000))");
+    interpreter.Run("(define z (cons (* 1000 100) (cons 2 3)))");
+    interpreter.Run("(define (f y) y)");
+    interpreter.CollectGarbage();
+    interpreter.Run("(f (cons 1 2))");
+    interpreter.CollectGarbage();
+
+    HeapStatistics stats = interpreter.HeapStats();
+    REQUIRE(stats.numbers.count == 1);
+    REQUIRE(stats.cells.count == 5);
+    REQUIRE(stats.constants.count >= 4);
+    REQUIRE(stats.lambdas.count == 1);
+    REQUIRE(stats.scopes.count == 1);
+    REQUIRE(stats.scopes.bytes > 0);
+    REQUIRE(stats.collections == 2);
+    REQUIRE(stats.minor_collections == 0);
+    REQUIRE(stats.last_reclaimed_bytes > 0);
+    REQUIRE(stats.total_reclaimed_bytes >= stats.last_reclaimed_bytes);
+    REQUIRE(stats.max_pause >= stats.p99_pause);
+    REQUIRE(stats.p99_pause >= stats.p50_pause);
+    REQUIRE(stats.total_pause >= stats.max_pause);
+    REQUIRE(stats.peak_heap_bytes >= stats.heap_bytes);
+    REQUIRE(stats.ToString().find("collections: 2") != std::string::npos);
+}
+
+TEST_CASE("GarbageIsSweptOnLaterAllocations") {
+    Interpreter interpreter;
+    interpreter.SetGcThreshold(1 << 30);
+    interpreter.SetGcNurserySize(1 << 30);
+    interpreter.Run("(define (build n) (if (= n 0) '() (cons (* n 10000) (build (- n 1)))))");
+    interpreter.Run("(define x (build 10))");
+    interpreter.Run("(define y (build 10))");
+    interpreter.CollectGarbage();
+    interpreter.Run("(define y (cons x (build 1000)))");
+    interpreter.Run("(build 1000)");
+
+    HeapStatistics stats = interpreter.HeapStats();
+    size_t size = stats.heap_bytes;
+    size_t reclaimed = stats.total_reclaimed_bytes;
+    interpreter.SetGcThreshold(size);
+    interpreter.Run("(car x)");
+    stats = interpreter.HeapStats();
+    REQUIRE(stats.collections == 2);
+    REQUIRE(stats.heap_bytes >= size);
+    REQUIRE(stats.total_reclaimed_bytes == reclaimed);
+    interpreter.Run("(set-car! (cdr y) (cons 5 6))");
+
+    interpreter.SetGcThreshold(1 << 30);
+    for (int i = 0; i < 100 && interpreter.HeapStats().total_reclaimed_bytes == reclaimed; ++i) {
+        interpreter.Run("(define z (cons (cons 1 2) (cons 3 4)))");
+    }
+    stats = interpreter.HeapStats();
+    REQUIRE(stats.total_reclaimed_bytes > reclaimed);
+    REQUIRE(stats.heap_bytes < size);
+
+    interpreter.SetGcNurserySize(0);
+    interpreter.Run("(define w (cons 7 8))");
+    interpreter.Run("(define w (cons 7 8))");
+    REQUIRE(interpreter.HeapStats().minor_collections == 2);
+    REQUIRE(interpreter.Run("(car (cdr y))") == "(5 . 6)");
+    REQUIRE(interpreter.Run("(car (cdr x))") == "90000");
+    REQUIRE(interpreter.Run("(car (cdr (car y)))") == "90000");
+    REQUIRE(interpreter.Run("(car z)") == "(1 . 2)");
+}
+
+TEST_CASE("QuotedDataIsNotShared") {
+    Interpreter interpreter;
+    interpreter.Run("(define z (quote 1))");
+    interpreter.Run("(define w 0)");
+    interpreter.Run("(define x '((1 . 2) 100000 (a b)))");
+    interpreter.Run("(define y '((1 . 2) 100000 (a b)))");
+    interpreter.CollectGarbage();
+    HeapStatistics stats = interpreter.HeapStats();
+    size_t constants = stats.constants.count;
+    // Numbers and symbols are pooled, the cells of each literal are its own.
+    REQUIRE(stats.numbers.count == 0);
+    REQUIRE(stats.cells.count == 12);
+    interpreter.Run("(define w (quote ((1 . 2) 100000 (a b))))");
+    interpreter.CollectGarbage();
+    REQUIRE(interpreter.HeapStats().constants.count == constants);
+    REQUIRE(interpreter.Run("(eq? (car (cdr x)) (car (cdr y)))") == "#t");
+    REQUIRE(interpreter.Run("(eq? (car x) (car y))") == "#f");
+    REQUIRE(interpreter.Run("''(1 2)") == "(' (1 2))");
+
+    interpreter.Run("(define a '(1 2 3))");
+    interpreter.Run("(define b '(1 2 3))");
+    interpreter.Run("(define c '(0 2 3))");
+    interpreter.Run("(set-car! a 9)");
+    interpreter.Run("(set-car! (cdr a) 7)");
+    REQUIRE(interpreter.Run("a") == "(9 7 3)");
+    REQUIRE(interpreter.Run("b") == "(1 2 3)");
+    REQUIRE(interpreter.Run("c") == "(0 2 3)");
+    REQUIRE(interpreter.Run("'(1 2 3)") == "(1 2 3)");
+
+    // A literal in the body of a lambda is copied once, when the lambda is made.
+    interpreter.Run("(define (f) '(1 2 3))");
+    interpreter.Run("(set-car! (f) 5)");
+    REQUIRE(interpreter.Run("(f)") == "(5 2 3)");
+    REQUIRE(interpreter.Run("b") == "(1 2 3)");
+
+    interpreter.Run("(set-car! (cdr x) (cons 5 6))");
+    interpreter.SetGcNurserySize(0);
+    interpreter.Run("(cons 7 8)");
+    interpreter.SetGcNurserySize(1 << 30);
+    interpreter.SetCompaction(true);
+    interpreter.CollectGarbage();
+    REQUIRE(interpreter.Run("x") == "((1 . 2) (5 . 6) (a b))");
+    REQUIRE(interpreter.Run("y") == "((1 . 2) 100000 (a b))");
+    REQUIRE(interpreter.Run("w") == "((1 . 2) 100000 (a b))");
+}
+
+TEST_CASE("ConstantsAreCollected") {
+    Interpreter interpreter;
+    interpreter.SetHeapLimit(1 << 20);
+    interpreter.Run("(define kept 'name)");
+    interpreter.Run("(define (f) 'body)");
+    for (int i = 0; i < 20000; ++i) {
+        std::string suffix = std::to_string(i);
+        interpreter.Run("'(symbol" + suffix + " " + std::to_string(1000000 + i) + ")");
+        if (i % 1000 == 0) {
+            interpreter.Run("(define var" + suffix + " " + suffix + ")");
+        }
+    }
+    interpreter.CollectGarbage();
+    HeapStatistics stats = interpreter.HeapStats();
+    REQUIRE(stats.constants.count < 1000);
+    REQUIRE(stats.constants.bytes < stats.heap_bytes);
+
+    // Names in use survive, and the ids of collected ones do not clash with them.
+    REQUIRE(interpreter.Run("kept") == "name");
+    REQUIRE(interpreter.Run("(eq? kept 'name)") == "#t");
+    REQUIRE(interpreter.Run("(f)") == "body");
+    REQUIRE(interpreter.Run("var5000") == "5000");
+    REQUIRE(interpreter.Run("(define other 1)") == "()");
+    REQUIRE(interpreter.Run("var19000") == "19000");
+    REQUIRE(interpreter.Run("other") == "1");
+
+    // Constants count towards the limits.
+    std::string many = "'(";
+    for (int i = 0; i < 1000; ++i) {
+        many += " name" + std::to_string(i);
+    }
+    stats = interpreter.HeapStats();
+    size_t objects = stats.numbers.count + stats.cells.count + stats.lists.count +
+                     stats.scopes.count + stats.lambdas.count + stats.symbols.count +
+                     stats.others.count + stats.constants.count;
+    interpreter.SetObjectLimit(objects + 500);
+    REQUIRE(interpreter.Run("'(name1 name2)") == "(name1 name2)");
+    REQUIRE_THROWS_AS(interpreter.Run(many + ")"), OutOfMemory);
+}
+
+TEST_CASE("ParseTreesAreReleasedAfterRun") {
+    Interpreter interpreter;
+    interpreter.SetGcThreshold(1 << 30);
+    interpreter.SetGcNurserySize(1 << 30);
+    interpreter.Run("(define (f x) (cons x '(1 2)))");
+    interpreter.Run("(define g (lambda (y) (if (= y 0) 0 (f y))))");
+    interpreter.Run("(define l (list (+ 1 2) (f 3)))");
+    interpreter.CollectGarbage();
+
+    size_t cells = interpreter.HeapStats().cells.count;
+    std::string sum = "(+";
+    for (int i = 0; i < 10000; ++i) {
+        sum += " (- " + std::to_string(i) + " 1)";
+    }
+    sum += ")";
+    REQUIRE(interpreter.Run(sum) == "49985000");
+    REQUIRE(interpreter.HeapStats().cells.count == cells);
+
+    interpreter.CollectGarbage();
+    REQUIRE(interpreter.Run("(g 5)") == "(5 1 2)");
+    REQUIRE(interpreter.Run("(f 7)") == "(7 1 2)");
+    REQUIRE(interpreter.Run("l") == "((+ 1 2) (f 3))");
+
+    // Builtins returning their arguments unevaluated promote them.
+    interpreter.Run("(define q quote)");
+    interpreter.Run("(define x (q (1 2)))");
+    interpreter.Run("(define y (quote (3 4)))");
+    REQUIRE(interpreter.Run("(list 7 8 9 10)") == "(7 8 9 10)");
+    REQUIRE(interpreter.Run("x") == "(1 2)");
+    REQUIRE(interpreter.Run("(car x)") == "1");
+    REQUIRE(interpreter.Run("y") == "(3 4)");
+    interpreter.Run("(set-car! x (cons 5 6))");
+    interpreter.SetGcNurserySize(0);
+    interpreter.Run("(cons 0 0)");
+    REQUIRE(interpreter.Run("x") == "((5 . 6) 2)");
+}
+
+TEST_CASE("CallFramesAreReused") {
+    Interpreter interpreter;
+    interpreter.SetGcThreshold(1 << 30);
+    interpreter.SetGcNurserySize(1 << 30);
+    interpreter.Run("(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+    interpreter.Run("(define (adder n) (lambda (x) (+ x n)))");
+    interpreter.Run("(define make lambda)");
+    interpreter.Run("(define (sneaky n) (make (x) (* x n)))");
+    interpreter.CollectGarbage();
+
+    size_t scopes = interpreter.HeapStats().scopes.count;
+    REQUIRE(interpreter.Run("(fib 15)") == "610");
+    REQUIRE(interpreter.HeapStats().scopes.count <= scopes + 15);
+    scopes = interpreter.HeapStats().scopes.count;
+    REQUIRE(interpreter.Run("(fib 10)") == "55");
+    REQUIRE(interpreter.HeapStats().scopes.count == scopes);
+
+    // Frames captured by a lambda keep their bindings.
+    interpreter.Run("(define add (adder 5))");
+    interpreter.Run("(define mul (sneaky 3))");
+    REQUIRE(interpreter.Run("(fib 10)") == "55");
+    interpreter.CollectGarbage();
+    REQUIRE(interpreter.Run("(add 1)") == "6");
+    REQUIRE(interpreter.Run("(mul 4)") == "12");
+}
+
+TEST_CASE("TailCallsRunInConstantSpace") {
+    Interpreter interpreter;
+    interpreter.SetGcThreshold(1 << 30);
+    interpreter.SetGcNurserySize(1 << 30);
+    interpreter.Run("(define (loop n) (if (= n 0) 0 (loop (- n 1))))");
+    interpreter.Run("(define (even n) (if (= n 0) #t (odd (- n 1))))");
+    interpreter.Run("(define (odd n) (if (= n 0) #f (even (- n 1))))");
+    interpreter.CollectGarbage();
+
+    size_t scopes = interpreter.HeapStats().scopes.count;
+    REQUIRE(interpreter.Run("(loop 100000)") == "0");
+    REQUIRE(interpreter.Run("(even 100001)") == "#f");
+    REQUIRE(interpreter.HeapStats().scopes.count <= scopes + 1);
+}
+
+TEST_CASE("ClosuresShareCompiledCode") {
+    Interpreter interpreter;
+    interpreter.Run("(define (adder n) (lambda (x) (+ x n)))");
+    interpreter.CollectGarbage();
+    size_t maker = interpreter.HeapStats().lambdas.bytes;
+
+    interpreter.Run("(define add1 (adder 1))");
+    interpreter.CollectGarbage();
+    size_t closure = interpreter.HeapStats().lambdas.bytes - maker;
+    interpreter.Run("(define add2 (adder 2))");
+    interpreter.CollectGarbage();
+    REQUIRE(interpreter.HeapStats().lambdas.bytes == maker + 2 * closure);
+    // Closures carry their parameters and body, the compiled code is left to the maker.
+    REQUIRE(closure * 2 < maker);
+
+    REQUIRE(interpreter.Run("(add1 5)") == "6");
+    REQUIRE(interpreter.Run("(add2 5)") == "7");
+}
@@ -0,0 +1,67 @@
+#include "scheme_test.h"
+
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+namespace {
+
+std::string ImagePath(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / name).string();
+}
+
+}  // namespace
+
+TEST_CASE("ImageRestoresDefinitions") {
+    std::string path = ImagePath("scheme_image_definitions.img");
+    {
+        Interpreter interpreter;
+        interpreter.Run("(define x '(1 2 (3 . 4) 100000))");
+        interpreter.Run("(define flag #f)");
+        interpreter.Run("(define name 'hello)");
+        interpreter.Run("(define (fib n) (if (< n 3) 1 (+ (fib (- n 1)) (fib (- n 2)))))");
+        interpreter.Run("(define (counter x) (lambda () (set! x (+ x 1)) x))");
+        interpreter.Run("(define next (counter 10))");
+        interpreter.Run("(next)");
+        interpreter.Run("(define plus +)");
+        interpreter.Run("(define y (cons x x))");
+        interpreter.SaveImage(path);
+    }
+
+    Interpreter interpreter;
+    interpreter.LoadImage(path);
+    REQUIRE(interpreter.Run("x") == "(1 2 (3 . 4) 100000)");
+    REQUIRE(interpreter.Run("flag") == "#f");
+    REQUIRE(interpreter.Run("name") == "hello");
+    REQUIRE(interpreter.Run("(fib 10)") == "55");
+    REQUIRE(interpreter.Run("(next)") == "12");
+    REQUIRE(interpreter.Run("(plus 1 2)") == "3");
+    REQUIRE(interpreter.Run("(quote (a b))") == "(a b)");
+
+    interpreter.Run("(set-car! x 5)");
+    REQUIRE(interpreter.Run("(car (cdr y))") == "5");
+    interpreter.CollectGarbage();
+    REQUIRE(interpreter.Run("(car (cdr y))") == "5");
+    REQUIRE(interpreter.Run("(next)") == "13");
+
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("InvalidImageIsRejected") {
+    std::string path = ImagePath("scheme_image_invalid.img");
+    {
+        Interpreter interpreter;
+        interpreter.Run("(define x '(1 2 3))");
+        interpreter.SaveImage(path);
+    }
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) / 2);
+
+    Interpreter interpreter;
+    interpreter.Run("(define x 1)");
+    REQUIRE_THROWS_AS(interpreter.LoadImage(path), RuntimeError);
+    REQUIRE_THROWS_AS(interpreter.LoadImage(ImagePath("scheme_image_missing.img")),
+                      RuntimeError);
+    REQUIRE(interpreter.Run("x") == "1");
+
+    std::filesystem::remove(path);
+}
@@ -152,3 +152,29 @@ TEST_CASE_METHOD(SchemeTest, "Redefinition and scoping") {
     ExpectEq("((foobar) 1 2)", "3");
     ExpectEq("(+ 1 2 -3)", "0");
 }
+
+TEST_CASE_METHOD(SchemeTest, "Builtins passed around") {
+    ExpectNoError("(define (inc x) (+ x 1))");
+    ExpectEq("(inc 1)", "2");
+    ExpectNoError("(define (apply-to f a b) (f a b))");
+    ExpectEq("(apply-to if #f 5)", "()");
+    ExpectEq("(apply-to cons 1 2)", "(1 . 2)");
+    ExpectNoError("(define + -)");
+    ExpectEq("(inc 1)", "0");
+    ExpectNoError("(define (cmp a) (< a (undefined)))");
+    ExpectRuntimeError("(cmp #t)");
+    ExpectNameError("(cmp 1)");
+}
+
+TEST_CASE_METHOD(SchemeTest, "Parameters shadowed by definitions") {
+    ExpectNoError("(define (nested a) (lambda (b) (lambda (c) (cons a (cons b c)))))");
+    ExpectEq("(((nested 1) 2) 3)", "(1 2 . 3)");
+    ExpectNoError("(define (shadow x) (define (g) (define x 100) ((lambda () x))) (g))");
+    ExpectEq("(shadow 5)", "100");
+    ExpectNoError("(define (late x) (define (g) x) (define x 9) (g))");
+    ExpectEq("(late 1)", "9");
+    ExpectNoError("(define (mut x) (define (inc) (set! x (+ x 1))) (inc) (inc) x)");
+    ExpectEq("(mut 40)", "42");
+    ExpectNoError("(define (last a a) a)");
+    ExpectEq("(last 1 2)", "2");
+}
@@ -57,3 +57,13 @@ TEST_CASE_METHOD(SchemeTest, "CopySemantics") {
 TEST_CASE_METHOD(SchemeTest, "EvaluationOrder") {
     ExpectNameError("(define x x)");
 }
+
+TEST_CASE_METHOD(SchemeTest, "SymbolIdentity") {
+    ExpectEq("(eq? 'x 'x)", "#t");
+    ExpectEq("(eq? 'x 'y)", "#f");
+    ExpectNoError("(define (name) 'x)");
+    ExpectEq("(eq? (name) (car '(x y)))", "#t");
+    ExpectEq("(eq? (cons 1 2) (cons 1 2))", "#f");
+    ExpectEq("(eq? '() '())", "#t");
+    ExpectRuntimeError("(eq? 'x)");
+}